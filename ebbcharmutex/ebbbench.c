@@ -0,0 +1,488 @@
+/**
+ * @file   ebbbench.c
+ * @brief  Benchmarks of the /dev/ebbchar LKM. Every test runs its operations for -t seconds
+ * and reports the operations and megabytes per second.
+ *
+ *    ebbbench numa [-s size] [-t seconds]
+ *       For every pair of NUMA nodes (S, C) opens the device from a CPU of node S, so the
+ *       session lives on S, then encrypts -s byte buffers from a CPU of node C. The diagonal is
+ *       the node local case. The node_stats attribute of the device is printed at the end.
+ *       To try it without a multi-socket host, boot a QEMU guest with emulated nodes, e.g.
+ *          -smp 4 -m 4G -object memory-backend-ram,id=m0,size=2G
+ *          -object memory-backend-ram,id=m1,size=2G
+ *          -numa node,nodeid=0,cpus=0-1,memdev=m0 -numa node,nodeid=1,cpus=2-3,memdev=m1
+ *
+ *    ebbbench hash [-t seconds]
+ *       SHA-256 of 64 byte to 4KiB messages, one EBBCHAR_IOC_HASH per message against batches
+ *       of BATCH messages through EBBCHAR_IOC_HASH_BATCH.
+ *
+ *    ebbbench tree [-t seconds]
+ *       SHA-256 of a TREE_SIZE registered buffer, one EBB_OP_HASH on a single CPU against
+ *       EBBCHAR_IOC_TREE_HASH with 64KiB to 4MiB chunks on all the CPUs. Registering the
+ *       buffer needs root or an RLIMIT_MEMLOCK of at least TREE_SIZE, and a fixed_max_mb of the
+ *       module of at least 256 (the default) with no other buffers registered.
+ *
+ *    ebbbench parallel [-t seconds]
+ *       CBC decryption, CTR and XTS of 16KiB to 16MiB buffers on the calling CPU against split
+ *       across all the CPUs, by switching the parallel_threshold attribute of the device (needs
+ *       root). The smallest size with a speedup is a good value for parallel_threshold; the
+ *       attribute is restored at the end.
+ *
+ *    ebbbench checksum [-t seconds]
+ *       SHA-1, crc32c and xxhash64 of a TREE_SIZE registered buffer through EBB_OP_HASH, next to
+ *       a user space memcpy() of the buffer as the memory bandwidth reference. Registering the
+ *       buffer needs the same as the tree test.
+*/
+#define _GNU_SOURCE
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<sched.h>
+#include<time.h>
+#include<sys/ioctl.h>
+#include<sys/mman.h>
+
+#include "ebbchar_ioctl.h"
+
+#define MAX_NODES 64
+#define NODE_PATH "/sys/devices/system/node"
+#define STATS_PATH "/sys/class/ebb/ebbchar"
+#define BATCH 256                       ///< Messages per EBBCHAR_IOC_HASH_BATCH of the hash test
+#define TREE_SIZE (256UL << 20)         ///< Input of the tree test
+
+static size_t size = 65536;             ///< Buffer size of one operation (-s)
+static double seconds = 2.0;            ///< Duration of one measurement (-t)
+
+static void die(const char *what){
+   perror(what);
+   exit(EXIT_FAILURE);
+}
+
+static double now(void){
+   struct timespec ts;
+
+   clock_gettime(CLOCK_MONOTONIC, &ts);
+   return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int open_device(void){
+   int fd = open("/dev/ebbchar", O_RDWR);
+
+   if (fd < 0)
+      die("Failed to open the device...");
+   return fd;
+}
+
+/// Creates an AES-128 key handle of alg with a fixed test key, XTS gets two different keys
+static int aes_key(int fd, __u32 alg){
+   unsigned char key[32] = "0123456789abcdeffedcba9876543210";
+   struct ebb_setkey sk;
+
+   memset(&sk, 0, sizeof(sk));
+   sk.alg = alg;
+   sk.keylen = alg == EBB_ALG_AES_XTS ? 32 : 16;
+   sk.key = (__u64)(unsigned long)key;
+   if (ioctl(fd, EBBCHAR_IOC_SETKEY, &sk) < 0)
+      die("Failed to set the key");
+   return sk.handle;
+}
+
+/// Runs op on buf in place with handle over and over for -t seconds, returns MB/s
+static double run_cipher(int fd, int handle, __u32 op, unsigned char *buf, size_t len){
+   struct ebb_cipher c;
+   double start = now(), elapsed;
+   long ops = 0;
+
+   memset(&c, 0, sizeof(c));
+   c.handle = handle;
+   c.op = op;
+   c.len = len;
+   c.in = c.out = (__u64)(unsigned long)buf;
+   do {
+      if (ioctl(fd, EBBCHAR_IOC_CIPHER, &c) < 0)
+         die("Failed to run the cipher");
+      ops++;
+   } while ((elapsed = now() - start) < seconds);
+   return ops * len / elapsed / 1e6;
+}
+
+/// Writes a value to a file of the device attributes
+static void write_attr(const char *name, const char *value){
+   char path[128];
+   FILE *f;
+
+   snprintf(path, sizeof(path), "%s/%s", STATS_PATH, name);
+   f = fopen(path, "w");
+   if (!f || fputs(value, f) < 0 || fclose(f))
+      die(path);
+}
+
+/// Prints a file of the device attributes
+static void print_attr(const char *name){
+   char path[128], line[256];
+   FILE *f;
+
+   snprintf(path, sizeof(path), "%s/%s", STATS_PATH, name);
+   f = fopen(path, "r");
+   if (!f)
+      return;
+   printf("%s:\n", name);
+   while (fgets(line, sizeof(line), f))
+      printf("   %s", line);
+   fclose(f);
+}
+
+/// Reads the CPUs of a node from its cpulist, returns 0 if the node does not exist
+static int node_cpus(int node, cpu_set_t *set){
+   char path[128], list[1024], *tok, *save;
+   int lo, hi, cpu;
+   FILE *f;
+
+   snprintf(path, sizeof(path), "%s/node%d/cpulist", NODE_PATH, node);
+   f = fopen(path, "r");
+   if (!f)
+      return 0;
+   CPU_ZERO(set);
+   if (!fgets(list, sizeof(list), f))
+      list[0] = '\0';
+   fclose(f);
+   for (tok = strtok_r(list, ",\n", &save); tok; tok = strtok_r(NULL, ",\n", &save)){
+      if (sscanf(tok, "%d-%d", &lo, &hi) != 2)
+         hi = lo = atoi(tok);
+      for (cpu = lo; cpu <= hi; cpu++)
+         CPU_SET(cpu, set);
+   }
+   return CPU_COUNT(set) > 0;
+}
+
+static void bind_node(cpu_set_t *set){
+   if (sched_setaffinity(0, sizeof(*set), set))
+      die("Failed to bind to the node");
+}
+
+static void bench_numa(void){
+   cpu_set_t cpus[MAX_NODES];
+   int nodes[MAX_NODES], nr = 0, s, c, fd, handle;
+   unsigned char *buf;
+
+   for (s = 0; s < MAX_NODES; s++)
+      if (node_cpus(s, &cpus[nr]))
+         nodes[nr++] = s;
+   if (nr == 0){
+      fprintf(stderr, "ebbbench: no NUMA node with CPUs found in %s\n", NODE_PATH);
+      exit(EXIT_FAILURE);
+   }
+
+   printf("encrypt MB/s of %zu byte buffers, rows: session node, columns: client node\n", size);
+   printf("%8s", "");
+   for (c = 0; c < nr; c++)
+      printf("   node%-4d", nodes[c]);
+   printf("\n");
+   for (s = 0; s < nr; s++){
+      bind_node(&cpus[s]);
+      fd = open_device();                            // the session is allocated on node s
+      handle = aes_key(fd, EBB_ALG_AES_CBC);
+      printf("node%-4d", nodes[s]);
+      for (c = 0; c < nr; c++){
+         bind_node(&cpus[c]);
+         buf = malloc(size);                        // first touched on the client node
+         if (!buf)
+            die("Failed to allocate the buffer");
+         memset(buf, 0x5a, size);
+         printf(" %10.1f", run_cipher(fd, handle, EBB_OP_ENCRYPT, buf, size));
+         fflush(stdout);
+         free(buf);
+      }
+      printf("\n");
+      close(fd);
+   }
+   print_attr("node_stats");
+}
+
+/// Hashes BATCH messages of len bytes one ioctl at a time for -t seconds, returns MB/s
+static double run_hash_single(int fd, unsigned char *msgs, size_t len){
+   struct ebb_hash h;
+   double start = now(), elapsed;
+   long ops = 0;
+   int i;
+
+   memset(&h, 0, sizeof(h));
+   h.alg = EBB_ALG_SHA256;
+   h.len = len;
+   do {
+      for (i = 0; i < BATCH; i++){
+         msgs[i * len] = (unsigned char)ops;         // keep a digest cache from answering
+         h.data = (__u64)(unsigned long)(msgs + i * len);
+         if (ioctl(fd, EBBCHAR_IOC_HASH, &h) < 0)
+            die("Failed to hash");
+      }
+      ops += BATCH;
+   } while ((elapsed = now() - start) < seconds);
+   return ops * len / elapsed / 1e6;
+}
+
+/// Hashes BATCH messages of len bytes per EBBCHAR_IOC_HASH_BATCH for -t seconds, returns MB/s
+static double run_hash_batch(int fd, unsigned char *msgs, size_t len){
+   static struct ebb_iovec iov[BATCH];
+   static unsigned char digests[BATCH * EBB_MAX_DIGEST_SIZE];
+   struct ebb_hash_batch b;
+   double start = now(), elapsed;
+   long ops = 0;
+   int i;
+
+   for (i = 0; i < BATCH; i++){
+      iov[i].base = (__u64)(unsigned long)(msgs + i * len);
+      iov[i].len = len;
+   }
+   memset(&b, 0, sizeof(b));
+   b.alg = EBB_ALG_SHA256;
+   b.count = BATCH;
+   b.msgs = (__u64)(unsigned long)iov;
+   b.digests = (__u64)(unsigned long)digests;
+   do {
+      if (ioctl(fd, EBBCHAR_IOC_HASH_BATCH, &b) < 0)
+         die("Failed to hash a batch");
+      ops += BATCH;
+   } while ((elapsed = now() - start) < seconds);
+   return ops * len / elapsed / 1e6;
+}
+
+static void bench_hash(void){
+   static const size_t sizes[] = { 64, 256, 1024, 4096 };
+   double single, batch;
+   unsigned char *msgs;
+   size_t i;
+   int fd;
+
+   msgs = malloc(BATCH * sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+   if (!msgs)
+      die("Failed to allocate the messages");
+   memset(msgs, 0x5a, BATCH * sizes[sizeof(sizes) / sizeof(sizes[0]) - 1]);
+   fd = open_device();
+   printf("%8s %14s %14s %8s\n", "size", "single MB/s", "batch MB/s", "speedup");
+   for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+      single = run_hash_single(fd, msgs, sizes[i]);
+      batch = run_hash_batch(fd, msgs, sizes[i]);
+      printf("%8zu %14.1f %14.1f %7.2fx\n", sizes[i], single, batch, batch / single);
+   }
+   close(fd);
+   free(msgs);
+}
+
+/// Digests the registered buffer 0 with EBB_OP_HASH of alg for -t seconds, returns MB/s
+static double run_hash_fixed(int fd, __u32 alg){
+   struct ebb_fixed_op op;
+   double start = now(), elapsed;
+   long ops = 0;
+
+   memset(&op, 0, sizeof(op));
+   op.op = EBB_OP_HASH;
+   op.alg = alg;
+   op.len = TREE_SIZE;
+   do {
+      if (ioctl(fd, EBBCHAR_IOC_FIXED, &op) < 0)
+         die("Failed to hash the buffer");
+      ops++;
+   } while ((elapsed = now() - start) < seconds);
+   return ops * TREE_SIZE / elapsed / 1e6;
+}
+
+/// Tree digests the registered buffer 0 with chunk byte leaves for -t seconds, returns MB/s
+static double run_hash_tree(int fd, unsigned int chunk){
+   struct ebb_tree_hash t;
+   double start = now(), elapsed;
+   long ops = 0;
+
+   memset(&t, 0, sizeof(t));
+   t.alg = EBB_ALG_SHA256;
+   t.chunk_size = chunk;
+   t.fd = -1;
+   do {
+      if (ioctl(fd, EBBCHAR_IOC_TREE_HASH, &t) < 0)
+         die("Failed to tree hash the buffer");
+      ops++;
+   } while ((elapsed = now() - start) < seconds);
+   return ops * TREE_SIZE / elapsed / 1e6;
+}
+
+/** @brief Maps a page aligned buffer of TREE_SIZE bytes. A malloc()ed one starts inside a page
+ *  and spans one page more than TREE_SIZE, which no longer fits the default fixed_max_mb of
+ *  the module.
+ */
+static unsigned char *map_tree_buffer(void){
+   void *p = mmap(NULL, TREE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+   if (p == MAP_FAILED)
+      die("Failed to map the buffer");
+   return p;
+}
+
+/// Registers buf of TREE_SIZE bytes as the read only buffer 0 of the session
+static void register_buffer(int fd, unsigned char *buf){
+   struct ebb_register reg;
+   struct ebb_iovec iov;
+
+   memset(&iov, 0, sizeof(iov));
+   iov.base = (__u64)(unsigned long)buf;
+   iov.len = TREE_SIZE;
+   iov.flags = EBB_IOV_READONLY;            // only hashed
+   memset(&reg, 0, sizeof(reg));
+   reg.count = 1;
+   reg.iovs = (__u64)(unsigned long)&iov;
+   if (ioctl(fd, EBBCHAR_IOC_REGISTER_BUFFERS, &reg) < 0)
+      die("Failed to register the buffer");
+}
+
+static void bench_tree(void){
+   static const unsigned int chunks[] = { 1 << 16, 1 << 18, 1 << 20, 1 << 22 };
+   double single, tree;
+   unsigned char *buf;
+   size_t i;
+   int fd;
+
+   buf = map_tree_buffer();
+   memset(buf, 0x5a, TREE_SIZE);
+   fd = open_device();
+   register_buffer(fd, buf);
+   single = run_hash_fixed(fd, EBB_ALG_SHA256);
+   printf("%8s %14s %8s\n", "chunk", "MB/s", "speedup");
+   printf("%8s %14.1f %7.2fx\n", "single", single, 1.0);
+   for (i = 0; i < sizeof(chunks) / sizeof(chunks[0]); i++){
+      tree = run_hash_tree(fd, chunks[i]);
+      printf("%8u %14.1f %7.2fx\n", chunks[i], tree, tree / single);
+   }
+   close(fd);
+   munmap(buf, TREE_SIZE);
+}
+
+static void bench_parallel(void){
+   static const struct { const char *name; __u32 alg, op; } modes[] = {
+      { "cbc-dec", EBB_ALG_AES_CBC, EBB_OP_DECRYPT },
+      { "ctr", EBB_ALG_AES_CTR, EBB_OP_ENCRYPT },
+      { "xts", EBB_ALG_AES_XTS, EBB_OP_ENCRYPT },
+   };
+   char saved[32] = "";
+   double single, split;
+   unsigned char *buf;
+   size_t len, m;
+   FILE *f;
+   int fd, handle;
+
+   f = fopen(STATS_PATH "/parallel_threshold", "r");
+   if (!f || !fgets(saved, sizeof(saved), f))
+      die("Failed to read parallel_threshold");
+   fclose(f);
+   buf = malloc(EBB_MAX_CIPHER_SIZE);
+   if (!buf)
+      die("Failed to allocate the buffer");
+   memset(buf, 0x5a, EBB_MAX_CIPHER_SIZE);
+   fd = open_device();
+   printf("%8s %10s %14s %14s %8s\n", "mode", "size", "single MB/s", "split MB/s", "speedup");
+   for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++){
+      handle = aes_key(fd, modes[m].alg);
+      for (len = 16384; len <= EBB_MAX_CIPHER_SIZE; len *= 4){
+         write_attr("parallel_threshold", "0");
+         single = run_cipher(fd, handle, modes[m].op, buf, len);
+         write_attr("parallel_threshold", "1");
+         split = run_cipher(fd, handle, modes[m].op, buf, len);
+         printf("%8s %10zu %14.1f %14.1f %7.2fx\n", modes[m].name, len, single, split,
+                split / single);
+      }
+   }
+   write_attr("parallel_threshold", saved);
+   close(fd);
+   free(buf);
+}
+
+static void bench_checksum(void){
+   static const struct { const char *name; __u32 alg; } algs[] = {
+      { "sha1", EBB_ALG_SHA1 },
+      { "crc32c", EBB_ALG_CRC32C },
+      { "xxhash64", EBB_ALG_XXH64 },
+   };
+   unsigned char *buf, *copy;
+   double start, elapsed;
+   long ops = 0;
+   size_t i;
+   int fd;
+
+   buf = map_tree_buffer();
+   copy = malloc(TREE_SIZE);
+   if (!copy)
+      die("Failed to allocate the buffer");
+   memset(buf, 0x5a, TREE_SIZE);
+   memset(copy, 0, TREE_SIZE);
+   start = now();
+   do {
+      memcpy(copy, buf, TREE_SIZE);
+      ops++;
+   } while ((elapsed = now() - start) < seconds);
+   printf("%10s %14s\n", "alg", "MB/s");
+   printf("%10s %14.1f\n", "memcpy", ops * TREE_SIZE / elapsed / 1e6);
+   free(copy);
+
+   fd = open_device();
+   register_buffer(fd, buf);
+   for (i = 0; i < sizeof(algs) / sizeof(algs[0]); i++)
+      printf("%10s %14.1f\n", algs[i].name, run_hash_fixed(fd, algs[i].alg));
+   close(fd);
+   munmap(buf, TREE_SIZE);
+}
+
+/// A benchmark of the tool
+struct bench {
+   const char *name;
+   void (*run)(void);
+};
+
+static const struct bench benches[] = {
+   { "numa", bench_numa },
+   { "hash", bench_hash },
+   { "tree", bench_tree },
+   { "parallel", bench_parallel },
+   { "checksum", bench_checksum },
+};
+
+static void usage(void){
+   size_t i;
+
+   fprintf(stderr, "usage: ebbbench <test> [-s size] [-t seconds]\ntests:");
+   for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+      fprintf(stderr, " %s", benches[i].name);
+   fprintf(stderr, "\n");
+   exit(EXIT_FAILURE);
+}
+
+int main(int argc, char *argv[]){
+   const struct bench *b = NULL;
+   size_t i;
+   int opt;
+
+   if (argc < 2)
+      usage();
+   for (i = 0; i < sizeof(benches) / sizeof(benches[0]); i++)
+      if (!strcmp(argv[1], benches[i].name))
+         b = &benches[i];
+   if (!b)
+      usage();
+   optind = 2;
+   while ((opt = getopt(argc, argv, "s:t:")) != -1){
+      switch (opt){
+      case 's':
+         size = strtoul(optarg, NULL, 0);
+         break;
+      case 't':
+         seconds = atof(optarg);
+         break;
+      default:
+         usage();
+      }
+   }
+   if (size == 0 || size % EBB_BLOCK_SIZE || size > EBB_MAX_CIPHER_SIZE || seconds <= 0)
+      usage();
+   b->run();
+   return 0;
+}
@@ -0,0 +1,231 @@
+/**
+ * @file   ebbchar_ioctl.h
+ * @brief  The ioctl interface of the /dev/ebbchar crypto device. This header is shared by the
+ * LKM (ebbcharmutex.c) and the user space programs, so it only uses the fixed-size types from
+ * linux/types.h. Pointers are always passed as __u64 and every struct is padded to a multiple
+ * of 8 bytes, so 32 and 64 bit callers see one layout and the same ioctl numbers.
+*/
+#ifndef EBBCHAR_IOCTL_H
+#define EBBCHAR_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+#define EBB_MAX_KEYS         16        ///< Key handles available to a session
+#define EBB_MAX_KEY_SIZE     128       ///< Largest key accepted by EBBCHAR_IOC_SETKEY
+#define EBB_MAX_DIGEST_SIZE  64        ///< Largest digest/MAC returned (sha512)
+#define EBB_MAX_MSG_SIZE     65536     ///< Largest single message accepted by the MAC ioctls
+#define EBB_MAX_BATCH        1024      ///< Largest number of messages in one batch
+#define EBB_MAX_HASH_SIZE    (1 << 24) ///< Largest buffer accepted by EBBCHAR_IOC_HASH
+#define EBB_MAX_CIPHER_SIZE  (1 << 24) ///< Largest buffer accepted by EBBCHAR_IOC_CIPHER
+#define EBB_BLOCK_SIZE       16        ///< AES block size
+#define EBB_MAX_FIXED_BUFS   64        ///< Largest number of registered buffers of a session
+#define EBB_MIN_TREE_CHUNK   4096      ///< Smallest chunk of EBBCHAR_IOC_TREE_HASH
+#define EBB_MAX_TREE_LEAVES  65536     ///< Largest number of chunks of one EBBCHAR_IOC_TREE_HASH
+#define EBB_XTS_SECTOR_SIZE  4096      ///< Data unit of EBB_ALG_AES_XTS
+#define EBB_IOV_READONLY     1         ///< Registered buffer the device only reads, see ebb_register
+
+/// Algorithms of the key handles and of the hash ioctls
+enum ebb_alg {
+   EBB_ALG_HMAC_SHA256 = 1,
+   EBB_ALG_HMAC_SHA512 = 2,
+   EBB_ALG_SHA1        = 3,            ///< Unkeyed digests, only valid for the hash ioctls
+   EBB_ALG_SHA256      = 4,
+   EBB_ALG_SHA512      = 5,
+   EBB_ALG_AES_CBC     = 6,            ///< AES-128/192/256 in CBC mode, only valid for the cipher ioctls
+   EBB_ALG_AES_CTR     = 7,            ///< AES in CTR mode, the IV is a 128 bit big endian counter
+   EBB_ALG_AES_XTS     = 8,            ///< AES-XTS with a double length key, see struct ebb_cipher
+   EBB_ALG_CRC32C      = 9,            ///< Non-cryptographic checksums, valid wherever the unkeyed
+   EBB_ALG_XXH64       = 10,           ///< digests are; returned as 4/8 little endian bytes
+};
+
+/// Direction of EBBCHAR_IOC_CIPHER
+enum ebb_op {
+   EBB_OP_ENCRYPT = 1,
+   EBB_OP_DECRYPT = 2,
+   EBB_OP_HASH    = 3,                 ///< Only valid for EBBCHAR_IOC_FIXED
+   EBB_OP_MAC     = 4,                 ///< Only valid for EBBCHAR_IOC_FIXED
+};
+
+/** @brief Create a key handle. The keyed transform is set up once here so the HMAC inner and
+ *  outer (ipad/opad) states are precomputed and reused by every later MAC on this handle.
+ */
+struct ebb_setkey {
+   __u32 alg;                          ///< One of enum ebb_alg
+   __u32 keylen;                       ///< Length of the key in bytes
+   __u64 key;                          ///< User pointer to the key bytes
+   __s32 handle;                       ///< Returned key handle
+   __u32 pad;
+};
+
+/// One message of a batch
+struct ebb_iovec {
+   __u64 base;                         ///< User pointer to the message
+   __u32 len;                          ///< Length of the message in bytes
+   __u32 flags;                        ///< EBB_IOV_* of a registered buffer, 0 otherwise
+};
+
+/// MAC a single message with a key handle
+struct ebb_mac {
+   __s32 handle;                       ///< Key handle from EBBCHAR_IOC_SETKEY
+   __u32 len;                          ///< Length of the message in bytes
+   __u64 data;                         ///< User pointer to the message
+   __u32 maclen;                       ///< Returned MAC length
+   __u8  mac[EBB_MAX_DIGEST_SIZE];     ///< Returned MAC
+   __u32 pad;
+};
+
+/** @brief MAC many short messages with one key handle in a single call. The MACs are written
+ *  back to back to macs, so the buffer must hold count * digest size bytes.
+ */
+struct ebb_mac_batch {
+   __s32 handle;                       ///< Key handle from EBBCHAR_IOC_SETKEY
+   __u32 count;                        ///< Number of entries in msgs
+   __u64 msgs;                         ///< User pointer to an array of struct ebb_iovec
+   __u64 macs;                         ///< User pointer to the output MACs
+};
+
+/** @brief Digest a user buffer. When the module is loaded with cache_entries > 0 the digest is
+ *  looked up in the content-addressed cache first (keyed by a 128 bit xxhash64 fingerprint with
+ *  secret per-load seeds and the length), so repeated inputs only cost the fingerprint.
+ *  Checksums are never cached.
+ */
+struct ebb_hash {
+   __u32 alg;                          ///< An unkeyed digest or checksum of enum ebb_alg
+   __u32 len;                          ///< Length of the buffer in bytes
+   __u64 data;                         ///< User pointer to the buffer
+   __u32 digestlen;                    ///< Returned digest length
+   __u8  digest[EBB_MAX_DIGEST_SIZE];  ///< Returned digest
+   __u32 pad;
+};
+
+/** @brief Digest a whole regular file. Cache entries of files are keyed by the (device, inode,
+ *  inode generation, size, mtime, ctime) identity of the file, so a hit does not read the file
+ *  at all.
+ *  Checksums are never cached.
+ */
+struct ebb_hash_fd {
+   __u32 alg;                          ///< An unkeyed digest or checksum of enum ebb_alg
+   __s32 fd;                           ///< Open file descriptor of a regular file
+   __u32 digestlen;                    ///< Returned digest length
+   __u8  digest[EBB_MAX_DIGEST_SIZE];  ///< Returned digest
+   __u32 pad;
+};
+
+/** @brief Encrypt or decrypt with an AES key handle. The IV is returned ready for the next
+ *  request of the stream:
+ *     CBC  the chaining value, i.e. the last ciphertext block
+ *     CTR  the counter of the block after the request
+ *     XTS  bytes 0-7 are the little endian number of the first EBB_XTS_SECTOR_SIZE data unit
+ *          (the dm-crypt plain64 tweak), bytes 8-15 are zero; len must be a multiple of
+ *          EBB_XTS_SECTOR_SIZE and the returned number is the unit after the request
+ *  Single block CBC requests may be coalesced with other single block requests of the same key
+ *  and direction, see the coalesce_window_us and coalesce_batch attributes of the device.
+ *  CTR, XTS and CBC decryption requests of at least parallel_threshold bytes are split into
+ *  segments that run on all the online CPUs; the output is the same as the one of a single CPU.
+ */
+struct ebb_cipher {
+   __s32 handle;                       ///< AES key handle from EBBCHAR_IOC_SETKEY
+   __u32 op;                           ///< One of enum ebb_op
+   __u32 len;                          ///< Length in bytes, a multiple of EBB_BLOCK_SIZE
+   __u32 pad;
+   __u64 in;                           ///< User pointer to the input
+   __u64 out;                          ///< User pointer to the output, may equal in
+   __u8  iv[EBB_BLOCK_SIZE];           ///< IV, updated to the chaining value of the next request
+};
+
+/** @brief Register user buffers with the session. The pages are pinned and their scatterlists
+ *  built once here, later EBBCHAR_IOC_FIXED requests only name a buffer index plus an offset and
+ *  a length. Hugepage backed buffers (e.g. mmap() with MAP_HUGETLB) give one scatterlist entry
+ *  per huge page. The pinned pages are charged to the pinned memory of the process, which
+ *  counts against RLIMIT_MEMLOCK (unless CAP_IPC_LOCK), and against the fixed_max_mb module
+ *  parameter. Buffers are pinned writable unless flagged EBB_IOV_READONLY; such a buffer can
+ *  be the input of any operation but EBBCHAR_IOC_FIXED refuses it as a cipher output with
+ *  EACCES. Only one set can be registered at a time, it is released by
+ *  EBBCHAR_IOC_UNREGISTER_BUFFERS or when the device is closed.
+ */
+struct ebb_register {
+   __u32 count;                        ///< Number of entries in iovs
+   __u32 pad;
+   __u64 iovs;                         ///< User pointer to an array of struct ebb_iovec
+};
+
+/// An operation on registered buffers, no data is copied between user and kernel memory
+struct ebb_fixed_op {
+   __u32 op;                           ///< One of enum ebb_op
+   __s32 handle;                       ///< Key handle for EBB_OP_ENCRYPT/DECRYPT/MAC
+   __u32 alg;                          ///< Digest or checksum of EBB_OP_HASH
+   __u32 index;                        ///< Registered buffer holding the input
+   __u64 offset;                       ///< Offset of the input in the buffer
+   __u32 len;                          ///< Length of the input in bytes
+   __u32 out_index;                    ///< Registered buffer receiving a cipher output
+   __u64 out_offset;                   ///< Offset of the cipher output, may equal the input
+   __u8  iv[EBB_BLOCK_SIZE];           ///< Cipher IV, updated as for struct ebb_cipher
+   __u32 digestlen;                    ///< Returned digest/MAC length
+   __u8  digest[EBB_MAX_DIGEST_SIZE];  ///< Returned digest/MAC
+   __u32 pad;
+};
+
+/** @brief Digest many independent messages in one call. The digests are written back to back to
+ *  digests, so the buffer must hold count * digest size bytes. Where the kernel has multi-buffer
+ *  SHA drivers the messages are hashed side by side in the SIMD lanes. Checksums are computed
+ *  one after the other, they cost less than queueing the messages.
+ */
+struct ebb_hash_batch {
+   __u32 alg;                          ///< An unkeyed digest or checksum of enum ebb_alg
+   __u32 count;                        ///< Number of entries in msgs
+   __u64 msgs;                         ///< User pointer to an array of struct ebb_iovec
+   __u64 digests;                      ///< User pointer to the output digests
+};
+
+/** @brief Tree digest of a large input. The input is split into chunk_size byte chunks (the last
+ *  one may be shorter) that are digested in parallel on all the online CPUs, then combined into
+ *  a binary hash tree laid out as in RFC 6962 (Certificate Transparency):
+ *
+ *     leaf = H(0x00 || chunk)
+ *     node = H(0x01 || left || right)
+ *
+ *  Each level pairs its nodes left to right; an odd node at the end of a level is promoted to
+ *  the next level unchanged. The root of a single chunk is its leaf, an empty input is one empty
+ *  chunk. The root only depends on alg, chunk_size and the bytes, never on the number of CPUs.
+ *  Leaf i covers bytes [offset + i * chunk_size, offset + (i + 1) * chunk_size) of the source, so
+ *  a client holding the leaf list can verify or re-digest a single chunk by itself, or pass the
+ *  range of that chunk back in to get its leaf.
+ */
+struct ebb_tree_hash {
+   __u32 alg;                          ///< An unkeyed digest or checksum of enum ebb_alg
+   __u32 chunk_size;                   ///< Bytes per leaf, at least EBB_MIN_TREE_CHUNK
+   __s32 fd;                           ///< Regular file to digest, or -1 for a registered buffer
+   __u32 index;                        ///< Registered buffer to digest when fd is -1
+   __u64 offset;                       ///< Start of the input in the file or buffer
+   __u64 len;                          ///< Length of the input, 0 digests up to the end
+   __u64 leaves;                       ///< User pointer receiving the leaf digests, may be 0
+   __u32 max_leaves;                   ///< Digests leaves has room for
+   __u32 nr_leaves;                    ///< Returned number of leaves, also on -ENOSPC
+   __u32 digestlen;                    ///< Returned digest length
+   __u32 pad;
+   __u8  digest[EBB_MAX_DIGEST_SIZE];  ///< Returned root digest
+};
+
+#define EBBCHAR_IOC_MAGIC      'e'
+#define EBBCHAR_IOC_SETKEY     _IOWR(EBBCHAR_IOC_MAGIC, 1, struct ebb_setkey)
+#define EBBCHAR_IOC_DELKEY     _IOW(EBBCHAR_IOC_MAGIC, 2, __s32)
+#define EBBCHAR_IOC_MAC        _IOWR(EBBCHAR_IOC_MAGIC, 3, struct ebb_mac)
+#define EBBCHAR_IOC_MAC_BATCH  _IOW(EBBCHAR_IOC_MAGIC, 4, struct ebb_mac_batch)
+#define EBBCHAR_IOC_HASH       _IOWR(EBBCHAR_IOC_MAGIC, 5, struct ebb_hash)
+#define EBBCHAR_IOC_HASH_FD    _IOWR(EBBCHAR_IOC_MAGIC, 6, struct ebb_hash_fd)
+#define EBBCHAR_IOC_CIPHER     _IOWR(EBBCHAR_IOC_MAGIC, 7, struct ebb_cipher)
+
+/* Streaming digest of one session, all three take a struct ebb_hash: INIT reads alg, UPDATE
+ * reads data and len (any length) and FINAL returns digest and digestlen. */
+#define EBBCHAR_IOC_HASH_INIT   _IOW(EBBCHAR_IOC_MAGIC, 8, struct ebb_hash)
+#define EBBCHAR_IOC_HASH_UPDATE _IOW(EBBCHAR_IOC_MAGIC, 9, struct ebb_hash)
+#define EBBCHAR_IOC_HASH_FINAL  _IOWR(EBBCHAR_IOC_MAGIC, 10, struct ebb_hash)
+
+#define EBBCHAR_IOC_REGISTER_BUFFERS   _IOW(EBBCHAR_IOC_MAGIC, 11, struct ebb_register)
+#define EBBCHAR_IOC_UNREGISTER_BUFFERS _IO(EBBCHAR_IOC_MAGIC, 12)
+#define EBBCHAR_IOC_FIXED              _IOWR(EBBCHAR_IOC_MAGIC, 13, struct ebb_fixed_op)
+#define EBBCHAR_IOC_HASH_BATCH         _IOW(EBBCHAR_IOC_MAGIC, 14, struct ebb_hash_batch)
+#define EBBCHAR_IOC_TREE_HASH          _IOWR(EBBCHAR_IOC_MAGIC, 15, struct ebb_tree_hash)
+
+#endif /* EBBCHAR_IOCTL_H */
@@ -16,6 +16,7 @@
 #include <linux/kernel.h>         // Contains types, macros, functions for the kernel
 #include <linux/fs.h>             // Header for the Linux file system support
 #include <linux/uaccess.h>          // Required for the copy to user function
+#include <linux/compat.h>           // compat_ptr(), 32 bit callers of the ioctls
 #include <linux/mutex.h>	  // Required for the mutex functionality
 #include <linux/moduleparam.h>
 #include <linux/stat.h>
@@ -30,7 +31,30 @@
 #include <linux/random.h>
 
 #include <crypto/internal/hash.h>
+#include <crypto/hash.h>          // ahash, used by the batched digests
 #include <linux/crypto.h>
+#include <linux/slab.h>
+#include <linux/mm.h>
+#include <linux/rwsem.h>
+#include <linux/file.h>
+#include <linux/sizes.h>
+#include <linux/hashtable.h>
+#include <linux/spinlock.h>
+#include <linux/xxhash.h>         // Cheap fingerprint of the digest cache, xxhash64 checksums
+#include <linux/crc32c.h>
+#include <crypto/sha.h>
+#include <crypto/aes.h>
+#include <crypto/algapi.h>        // crypto_xor()
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
+#include <linux/sched/signal.h>   // rlimit()
+#include <linux/sched/mm.h>       // mmgrab(), mmdrop()
+#include <linux/capability.h>
+#include <linux/topology.h>       // numa_node_id(), cpumask_of_node()
+#include <linux/nodemask.h>
+#include <asm/unaligned.h>        // get_unaligned_be64(), the CTR counter and XTS sector of an IV
+
+#include "ebbchar_ioctl.h"        // ioctl interface shared with the user space programs
 
 
 #define  DEVICE_NAME "ebbchar"    ///< The device will appear at /dev/ebbchar using this value
@@ -42,22 +66,81 @@ MODULE_DESCRIPTION("A simple Linux char driver for the BBB");  ///< The descript
 MODULE_VERSION("0.1");            ///< A version number to inform users
 
 static int    majorNumber;                  ///< Store the device number -- determined automatically
-static char   message[256] = {0};           ///< Memory for the string that is passed from userspace
-static short  size_of_message;              ///< Used to remember the size of the string stored
 static int    numberOpens = 0;              ///< Counts the number of times the device is opened
 static struct class*  ebbcharClass  = NULL; ///< The device-driver class struct pointer
 static struct device* ebbcharDevice = NULL; ///< The device-driver device struct pointer
-char buffer_out[25];			    ///< Store of the Hash
-char encript[32];
 
 static DEFINE_MUTEX(ebbchar_mutex);	    ///< Macro to declare a new mutex
 
+struct ebb_key;
+
+/** @brief A queue of pending single block requests of one key and direction. Requests wait
+ *  here for up to coalesce_window_us or until coalesce_batch of them arrived, then the whole
+ *  batch runs as one multi-entry scatterlist operation.
+ */
+struct ebb_sched_queue {
+   spinlock_t lock;                         ///< Protects pending and nr
+   struct list_head pending;                ///< struct ebb_sched_req waiting for the batch
+   unsigned int nr;                         ///< Number of requests on pending
+   struct ebb_key *key;                     ///< The key all requests of the queue use
+   int enc;                                 ///< 1 encrypts, 0 decrypts
+   int node;                                ///< NUMA node the batches run on
+   struct hrtimer timer;                    ///< Fires when the window of the oldest request ends
+   struct work_struct work;                 ///< Runs the batch once the window expired
+};
+
+/// A key handle -- the keyed transforms are allocated and keyed once by EBBCHAR_IOC_SETKEY
+struct ebb_key {
+   __u32 alg;                               ///< enum ebb_alg of this handle
+   int node;                                ///< NUMA node of the session owning the key
+   struct crypto_shash *shash;              ///< hmac(shaX) transform, ipad/opad precomputed by setkey
+   struct crypto_skcipher *skcipher;        ///< cbc(aes), ctr(aes) or xts(aes) transform of the unbatched path
+   struct crypto_skcipher *ecb;             ///< ecb(aes) transform the coalesced batches run on
+   struct ebb_sched_queue queue[2];         ///< Coalescing queues, indexed by enc
+};
+
+/// A user buffer registered by EBBCHAR_IOC_REGISTER_BUFFERS, pinned until unregistered
+struct ebb_fixed_buf {
+   struct page **pages;                     ///< The pinned pages
+   unsigned int nr_pages;
+   struct sg_table sgt;                     ///< Scatterlist of the whole buffer, built once
+   u64 len;                                 ///< Length of the buffer in bytes
+   int write;                               ///< Pinned writable, the pages are dirtied on release
+};
+
+/** @brief Per open state of the device, stored in filep->private_data. It is allocated on the
+ *  NUMA node of the CPU that opened the device; the keys, bounce buffers and deferred work of
+ *  the session are placed on the same node.
+ */
+struct ebb_session {
+   int node;                                ///< NUMA node of the opening CPU
+   char message[256];                       ///< Memory for the string that is passed from userspace
+   short size_of_message;                   ///< Used to remember the size of the string stored
+   char buffer_out[25];                     ///< Store of the Hash
+   char encript[32];                        ///< Result of the last 'e'/'d' command
+   struct rw_semaphore keys_sem;            ///< Held for read by operations, for write by (de)setkey
+   struct ebb_key *keys[EBB_MAX_KEYS];      ///< The key handles of this session, NULL if free
+   struct mutex stream_lock;                ///< Serializes the streaming hash ioctls
+   struct crypto_shash *stream_tfm;         ///< Transform of the streaming hash, NULL if idle
+   struct shash_desc *stream;               ///< State of the streaming hash, NULL if idle
+   struct rw_semaphore bufs_sem;            ///< Held for read by fixed operations, for write by (un)register
+   struct ebb_fixed_buf *bufs;              ///< The registered buffers, NULL if none
+   unsigned int nr_bufs;                    ///< Number of entries in bufs
+   unsigned long pinned;                    ///< Pages pinned by bufs
+   struct mm_struct *pinned_mm;             ///< mm the pinned pages are charged to, NULL if none
+   struct crypto_shash *fixed_tfm[EBB_ALG_XXH64 + 1]; ///< Digests of EBB_OP_HASH, by alg, on first use
+};
+
 
 /// The prototype functions for the character driver -- must come before the struct definition
 static int     dev_open(struct inode *, struct file *);
 static int     dev_release(struct inode *, struct file *);
 static ssize_t dev_read(struct file *, char *, size_t, loff_t *);
 static ssize_t dev_write(struct file *, const char *, size_t, loff_t *);
+static long    dev_ioctl(struct file *, unsigned int, unsigned long);
+#ifdef CONFIG_COMPAT
+static long    dev_compat_ioctl(struct file *, unsigned int, unsigned long);
+#endif
 
 //VAriaveis para o recebimento dos parametros via linha de comando
 static char *key = ""; 
@@ -66,6 +149,18 @@ MODULE_PARM_DESC(key, "A character string");
 static char *iv = ""; 
 module_param(iv, charp, 0000); 
 MODULE_PARM_DESC(iv, "A character string");
+static unsigned int cache_entries = 0;
+module_param(cache_entries, uint, 0644);
+MODULE_PARM_DESC(cache_entries, "Digests kept by the content-addressed hash cache (0 disables it)");
+
+static unsigned int coalesce_window_us = 100;   ///< Longest wait of a single block request for its batch
+static unsigned int coalesce_batch = 1;         ///< Requests per batch, 1 disables coalescing
+static struct workqueue_struct *ebb_wq;         ///< Module workqueue running the deferred work
+static unsigned int parallel_threshold = SZ_512K; ///< Smallest request split across CPUs, 0 disables
+
+static unsigned int fixed_max_mb = 256;
+module_param(fixed_max_mb, uint, 0644);
+MODULE_PARM_DESC(fixed_max_mb, "Memory all sessions together may pin as registered buffers, in MiB");
 //////////////////////////////////////////////////////////////////
 
 /**
@@ -78,9 +173,194 @@ static struct file_operations fops =
    .open = dev_open,
    .read = dev_read,
    .write = dev_write,
+   .unlocked_ioctl = dev_ioctl,
+#ifdef CONFIG_COMPAT
+   .compat_ioctl = dev_compat_ioctl,
+#endif
    .release = dev_release,
 };
 
+static atomic_long_t ebb_cache_hits = ATOMIC_LONG_INIT(0);   ///< Digests served from the cache
+static atomic_long_t ebb_cache_misses = ATOMIC_LONG_INIT(0); ///< Digests computed while the cache was enabled
+static unsigned long ebb_cache_count;       ///< Number of entries in the digest cache
+static u64 ebb_cache_seed[2];               ///< Secret seeds of the cache fingerprint, drawn at load
+static struct shrinker ebb_cache_shrinker;  ///< Lets the VM reclaim digest cache entries
+static struct shash_alg ebb_xxh64_alg;      ///< xxhash64 as a shash, the kernel only has the library
+static void ebb_cache_flush(void);
+static void ebb_mb_free(void);
+
+static atomic_long_t ebb_sched_batches = ATOMIC_LONG_INIT(0);  ///< Coalesced batches run
+static atomic_long_t ebb_sched_requests = ATOMIC_LONG_INIT(0); ///< Requests run in coalesced batches
+
+static atomic_long_t ebb_pinned_pages = ATOMIC_LONG_INIT(0);  ///< Pages pinned by registered buffers
+
+/// Per NUMA node statistics, indexed by the node of the session
+struct ebb_node_stats {
+   atomic_long_t opens;                     ///< Sessions opened on the node
+   atomic_long_t ops;                       ///< Operations of sessions of the node
+   atomic_long_t remote_ops;                ///< ... issued from a CPU of another node
+   atomic_long_t bytes;                     ///< Bytes processed by those operations
+};
+static struct ebb_node_stats *ebb_node_stats; ///< nr_node_ids entries
+
+/** @brief Accounts an operation of a session in the statistics of its node
+ *  @param session The session
+ *  @param bytes The bytes processed by the operation
+ */
+static void ebb_account(struct ebb_session *session, size_t bytes){
+   struct ebb_node_stats *st = &ebb_node_stats[session->node];
+
+   atomic_long_inc(&st->ops);
+   atomic_long_add(bytes, &st->bytes);
+   if (numa_node_id() != session->node)
+      atomic_long_inc(&st->remote_ops);
+}
+
+/** @brief Picks an online CPU of a node to run deferred work of that node on
+ *  @param node The NUMA node
+ *  @return the CPU, or WORK_CPU_UNBOUND if the node has no online CPU
+ */
+static int ebb_node_cpu(int node){
+   int cpu = cpumask_any_and(cpumask_of_node(node), cpu_online_mask);
+
+   return cpu < nr_cpu_ids ? cpu : WORK_CPU_UNBOUND;
+}
+
+/** @brief Picks the CPU of the i-th piece of work spread over all the online CPUs, the CPUs of
+ *  the given node come first
+ *  @param node The NUMA node of the session
+ *  @param i Index of the piece of work
+ *  @return the CPU, or WORK_CPU_UNBOUND if there are fewer than i + 1 online CPUs
+ */
+static int ebb_spread_cpu(int node, unsigned int i){
+   int cpu;
+
+   for_each_cpu_and(cpu, cpumask_of_node(node), cpu_online_mask)
+      if (i-- == 0)
+         return cpu;
+   for_each_online_cpu(cpu)
+      if (cpu_to_node(cpu) != node && i-- == 0)
+         return cpu;
+   return WORK_CPU_UNBOUND;
+}
+
+/** @brief The device statistics, exported as read only attributes of /sys/class/ebb/ebbchar
+ *  @param dev The device the attribute belongs to
+ *  @param attr The attribute being read
+ *  @param buf The page the value is printed to
+ */
+static ssize_t opens_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%d\n", numberOpens);
+}
+static DEVICE_ATTR_RO(opens);
+
+static ssize_t cache_hits_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%ld\n", atomic_long_read(&ebb_cache_hits));
+}
+static DEVICE_ATTR_RO(cache_hits);
+
+static ssize_t cache_misses_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%ld\n", atomic_long_read(&ebb_cache_misses));
+}
+static DEVICE_ATTR_RO(cache_misses);
+
+static ssize_t cache_count_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%lu\n", READ_ONCE(ebb_cache_count));
+}
+static DEVICE_ATTR_RO(cache_count);
+
+static ssize_t coalesce_batches_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%ld\n", atomic_long_read(&ebb_sched_batches));
+}
+static DEVICE_ATTR_RO(coalesce_batches);
+
+static ssize_t coalesce_requests_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%ld\n", atomic_long_read(&ebb_sched_requests));
+}
+static DEVICE_ATTR_RO(coalesce_requests);
+
+static ssize_t fixed_pinned_pages_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%ld\n", atomic_long_read(&ebb_pinned_pages));
+}
+static DEVICE_ATTR_RO(fixed_pinned_pages);
+
+static ssize_t node_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+   struct ebb_node_stats *st;
+   ssize_t n = 0;
+   int node;
+
+   for_each_node(node){
+      st = &ebb_node_stats[node];
+      n += scnprintf(buf + n, PAGE_SIZE - n, "node%d opens %ld ops %ld remote_ops %ld bytes %ld\n",
+                     node, atomic_long_read(&st->opens), atomic_long_read(&st->ops),
+                     atomic_long_read(&st->remote_ops), atomic_long_read(&st->bytes));
+   }
+   return n;
+}
+static DEVICE_ATTR_RO(node_stats);
+
+/// The tunables of the coalescing scheduler, read/write attributes next to the statistics
+static ssize_t coalesce_window_us_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%u\n", READ_ONCE(coalesce_window_us));
+}
+
+static ssize_t coalesce_window_us_store(struct device *dev, struct device_attribute *attr,
+                                        const char *buf, size_t count){
+   unsigned int val;
+
+   if (kstrtouint(buf, 0, &val) || val > USEC_PER_SEC)
+      return -EINVAL;
+   WRITE_ONCE(coalesce_window_us, val);
+   return count;
+}
+static DEVICE_ATTR_RW(coalesce_window_us);
+
+static ssize_t coalesce_batch_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%u\n", READ_ONCE(coalesce_batch));
+}
+
+static ssize_t coalesce_batch_store(struct device *dev, struct device_attribute *attr,
+                                    const char *buf, size_t count){
+   unsigned int val;
+
+   if (kstrtouint(buf, 0, &val) || val == 0 || val > EBB_MAX_BATCH)
+      return -EINVAL;
+   WRITE_ONCE(coalesce_batch, val);
+   return count;
+}
+static DEVICE_ATTR_RW(coalesce_batch);
+
+static ssize_t parallel_threshold_show(struct device *dev, struct device_attribute *attr, char *buf){
+   return sprintf(buf, "%u\n", READ_ONCE(parallel_threshold));
+}
+
+static ssize_t parallel_threshold_store(struct device *dev, struct device_attribute *attr,
+                                        const char *buf, size_t count){
+   unsigned int val;
+
+   if (kstrtouint(buf, 0, &val))
+      return -EINVAL;
+   WRITE_ONCE(parallel_threshold, val);
+   return count;
+}
+static DEVICE_ATTR_RW(parallel_threshold);
+
+static struct attribute *ebbchar_attrs[] = {
+   &dev_attr_opens.attr,
+   &dev_attr_cache_hits.attr,
+   &dev_attr_cache_misses.attr,
+   &dev_attr_cache_count.attr,
+   &dev_attr_coalesce_batches.attr,
+   &dev_attr_coalesce_requests.attr,
+   &dev_attr_fixed_pinned_pages.attr,
+   &dev_attr_node_stats.attr,
+   &dev_attr_coalesce_window_us.attr,
+   &dev_attr_coalesce_batch.attr,
+   &dev_attr_parallel_threshold.attr,
+   NULL,
+};
+ATTRIBUTE_GROUPS(ebbchar);
+
 /** @brief The LKM initialization function
  *  The static keyword restricts the visibility of the function to within this C file. The __init
  *  macro means that for a built-in driver (not a LKM) the function is only used at initialization
@@ -88,11 +368,28 @@ static struct file_operations fops =
  *  @return returns 0 if successful
  */
 static int __init ebbchar_init(void){
+   int ret;
+
    printk(KERN_INFO "EBBChar: Initializing the EBBChar LKM\n");
+   get_random_bytes(ebb_cache_seed, sizeof(ebb_cache_seed));   // secret fingerprint seeds
+
+   // The workqueue runs the deferred work of the module, e.g. the expired coalescing windows
+   // It is a per-cpu workqueue so work queued on a CPU of a node stays on that node
+   ebb_wq = alloc_workqueue("ebbchar", WQ_HIGHPRI, 0);
+   ebb_node_stats = kcalloc(nr_node_ids, sizeof(*ebb_node_stats), GFP_KERNEL);
+   if (!ebb_wq || !ebb_node_stats){
+      if (ebb_wq)
+         destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
+      printk(KERN_ALERT "EBBChar failed to allocate its workqueue\n");
+      return -ENOMEM;
+   }
 
    // Try to dynamically allocate a major number for the device -- more difficult but worth it
    majorNumber = register_chrdev(0, DEVICE_NAME, &fops);
    if (majorNumber<0){
+      destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
       printk(KERN_ALERT "EBBChar failed to register a major number\n");
       return majorNumber;
    }
@@ -102,19 +399,44 @@ static int __init ebbchar_init(void){
    ebbcharClass = class_create(THIS_MODULE, CLASS_NAME);
    if (IS_ERR(ebbcharClass)){           // Check for error and clean up if there is
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
       printk(KERN_ALERT "Failed to register device class\n");
       return PTR_ERR(ebbcharClass);     // Correct way to return an error on a pointer
    }
    printk(KERN_INFO "EBBChar: device class registered correctly\n");
 
    // Register the device driver
-   ebbcharDevice = device_create(ebbcharClass, NULL, MKDEV(majorNumber, 0), NULL, DEVICE_NAME);
+   ebbcharDevice = device_create_with_groups(ebbcharClass, NULL, MKDEV(majorNumber, 0), NULL,
+                                             ebbchar_groups, DEVICE_NAME);
    if (IS_ERR(ebbcharDevice)){          // Clean up if there is an error
       class_destroy(ebbcharClass);      // Repeated code but the alternative is goto statements
       unregister_chrdev(majorNumber, DEVICE_NAME);
+      destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
       printk(KERN_ALERT "Failed to create the device\n");
       return PTR_ERR(ebbcharDevice);
    }
+   if (register_shrinker(&ebb_cache_shrinker)){
+      device_destroy(ebbcharClass, MKDEV(majorNumber, 0));
+      class_destroy(ebbcharClass);
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
+      printk(KERN_ALERT "Failed to register the digest cache shrinker\n");
+      return -ENOMEM;
+   }
+   ret = crypto_register_shash(&ebb_xxh64_alg);
+   if (ret){
+      unregister_shrinker(&ebb_cache_shrinker);
+      device_destroy(ebbcharClass, MKDEV(majorNumber, 0));
+      class_destroy(ebbcharClass);
+      unregister_chrdev(majorNumber, DEVICE_NAME);
+      destroy_workqueue(ebb_wq);
+      kfree(ebb_node_stats);
+      printk(KERN_ALERT "Failed to register the xxhash64 transform\n");
+      return ret;
+   }
    printk(KERN_INFO "EBBChar: device class created correctly\n"); // Made it! device was initialized
    mutex_init(&ebbchar_mutex);          // Initialize the mutex dynamically
    return 0;
@@ -125,25 +447,44 @@ static int __init ebbchar_init(void){
  *  code is used for a built-in driver (not a LKM) that this function is not required.
  */
 static void __exit ebbchar_exit(void){
+   unregister_shrinker(&ebb_cache_shrinker);            // stop reclaim before the cache goes away
+   ebb_cache_flush();                                   // free the cached digests
+   ebb_mb_free();                                       // free the batched hash transforms
+   crypto_unregister_shash(&ebb_xxh64_alg);             // no transform of it is left
    mutex_destroy(&ebbchar_mutex);                       // destroy the dynamically-allocated mutex
    device_destroy(ebbcharClass, MKDEV(majorNumber, 0)); // remove the device
    class_unregister(ebbcharClass);                      // unregister the device class
    class_destroy(ebbcharClass);                         // remove the device class
    unregister_chrdev(majorNumber, DEVICE_NAME);         // unregister the major number
+   destroy_workqueue(ebb_wq);                           // no session is left to queue work
+   kfree(ebb_node_stats);
    printk(KERN_INFO "EBBChar: Goodbye from the LKM!\n");
 }
 
 /** @brief The device open function that is called each time the device is opened
- *  This will only increment the numberOpens counter in this case.
+ *  This increments the numberOpens counter and allocates the session of this open.
  *  @param inodep A pointer to an inode object (defined in linux/fs.h)
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_open(struct inode *inodep, struct file *filep){
+   struct ebb_session *session;
+   int node = numa_node_id();                           // read once, the task may migrate
 
    if(!mutex_trylock(&ebbchar_mutex)){                  // Try to acquire the mutex (returns 0 on fail)
 	printk(KERN_ALERT "EBBChar: Device in use by another process");
 	return -EBUSY;
    }
+   session = kzalloc_node(sizeof(*session), GFP_KERNEL, node);
+   if (!session){
+      mutex_unlock(&ebbchar_mutex);
+      return -ENOMEM;
+   }
+   session->node = node;
+   atomic_long_inc(&ebb_node_stats[session->node].opens);
+   init_rwsem(&session->keys_sem);
+   mutex_init(&session->stream_lock);
+   init_rwsem(&session->bufs_sem);
+   filep->private_data = session;
    numberOpens++;
    printk(KERN_INFO "EBBChar: Device has been opened %d time(s)\n", numberOpens);
    return 0;
@@ -221,7 +562,7 @@ static unsigned int test_skcipher_encdec(struct skcipher_def *sk,
 
 
 /* Initialize and trigger cipher operation */
-static int test_skcipher(int size, char *varEncript, char option, char *number)
+static int test_skcipher(struct ebb_session *session, int size, char *varEncript, char option, char *number)
 {
     struct skcipher_def sk;
     struct crypto_skcipher *skcipher = NULL;
@@ -255,21 +596,21 @@ static int test_skcipher(int size, char *varEncript, char option, char *number)
         ret = -EAGAIN;
         goto out;
     }
-    ivdata = vmalloc(16);
+    ivdata = kzalloc_node(16, GFP_KERNEL, session->node);
     if (!ivdata) {
         pr_info("could not allocate ivdata\n");
         goto out;
     }
-    strcpy(ivdata, iv);
+    strncpy(ivdata, iv, 16);                  // exactly one block, longer parameters are cut
     
 
     /* Input data will be random */
-    scratchpad = vmalloc(16);
+    scratchpad = kzalloc_node(17, GFP_KERNEL, session->node);   // the block plus a NUL for the result
     if (!scratchpad) {
         pr_info("could not allocate scratchpad\n");
         goto out;
     }
-    strcpy(scratchpad, varEncript);
+    strncpy(scratchpad, varEncript, 16);
 
     sk.tfm = skcipher;
     sk.req = req;
@@ -292,7 +633,7 @@ static int test_skcipher(int size, char *varEncript, char option, char *number)
     char *resultdata = sg_virt(&sk.sg);
 
 print_hex_dump(KERN_DEBUG, "texto: ", DUMP_PREFIX_NONE, 16,1, resultdata, 16, true);
-strcpy(encript, resultdata);
+strcpy(session->encript, resultdata);
 int w=0;
 while(w<strlen(resultdata)){printk(KERN_INFO "Encriptedddd: %x", resultdata[w]); w++;}
     pr_info("Encryption triggered successfully\n");
@@ -303,9 +644,9 @@ out:
     if (req)
         skcipher_request_free(req);
     if (ivdata)
-        vfree(ivdata);
+        kfree(ivdata);
     if (scratchpad)
-        vfree(scratchpad);
+        kfree(scratchpad);
     return ret;
 }
 //////FIM DA ENCRIPTATION////////////////////////////////////////////////////////////////////////////////////
@@ -355,11 +696,10 @@ static int calc_hash(struct crypto_shash *alg,
    return ret;
 }
 
-static int test_hash(const unsigned char *data, unsigned int datalen,
+static int test_hash(const char *hash_tipo, const unsigned char *data, unsigned int datalen,
              unsigned char *digest, unsigned int *hash_len)
 {
     struct crypto_shash *alg;
-    char *hash_tipo = "sha1";
     int ret;
 
     alg = crypto_alloc_shash(hash_tipo, CRYPTO_ALG_TYPE_SHASH, 0);
@@ -374,15 +714,2316 @@ static int test_hash(const unsigned char *data, unsigned int datalen,
 }
 //FIM da HASH////
 
-static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
+//AGENDADOR DE BLOCOS PEQUENOS////
+
+/// One single block request waiting in an ebb_sched_queue. It lives on the stack of the caller,
+/// so the crypto API never sees its block, ebb_sched_run() copies the blocks out first.
+struct ebb_sched_req {
+   struct list_head list;                   ///< Link in ebb_sched_queue.pending
+   u8 block[AES_BLOCK_SIZE];                ///< The input block, replaced by the output block
+   u8 iv[AES_BLOCK_SIZE];                   ///< The CBC IV of this request
+   int err;                                 ///< Result of the batch the request ran in
+   struct completion done;                  ///< Completed once the batch ran
+};
+
+/** @brief Runs a detached batch and completes its requests. A one block CBC operation is
+ *  ECB(block ^ iv) when encrypting and ECB^-1(block) ^ iv when decrypting, so requests with
+ *  different IVs can still share a single ecb(aes) request. The blocks are gathered into one
+ *  kmalloc()ed buffer (a scatterlist must not point into a stack, which may be vmalloc()ed) and
+ *  the setup and completion costs are paid once per batch instead of per block.
+ *  @param q The queue the batch was taken from
+ *  @param batch The detached requests
+ *  @param nr The number of requests on batch
+ */
+static void ebb_sched_run(struct ebb_sched_queue *q, struct list_head *batch, unsigned int nr){
+   struct ebb_sched_req *r, *tmp;
+   struct skcipher_request *req;
+   struct scatterlist sg;
+   DECLARE_CRYPTO_WAIT(wait);
+   unsigned int i = 0;
+   u8 *blocks;
+   int ret;
+
+   blocks = kmalloc_node(nr * AES_BLOCK_SIZE, GFP_KERNEL, q->node);
+   req = skcipher_request_alloc(q->key->ecb, GFP_KERNEL);
+   if (!blocks || !req){
+      ret = -ENOMEM;
+      goto out;
+   }
+   list_for_each_entry(r, batch, list){
+      memcpy(blocks + i * AES_BLOCK_SIZE, r->block, AES_BLOCK_SIZE);
+      if (q->enc)
+         crypto_xor(blocks + i * AES_BLOCK_SIZE, r->iv, AES_BLOCK_SIZE);
+      i++;
+   }
+   sg_init_one(&sg, blocks, nr * AES_BLOCK_SIZE);
+   skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+                                 crypto_req_done, &wait);
+   skcipher_request_set_crypt(req, &sg, &sg, nr * AES_BLOCK_SIZE, NULL);
+   if (q->enc)
+      ret = crypto_wait_req(crypto_skcipher_encrypt(req), &wait);
+   else
+      ret = crypto_wait_req(crypto_skcipher_decrypt(req), &wait);
+   i = 0;
+   list_for_each_entry(r, batch, list){
+      if (ret)
+         break;
+      memcpy(r->block, blocks + i++ * AES_BLOCK_SIZE, AES_BLOCK_SIZE);
+      if (!q->enc)
+         crypto_xor(r->block, r->iv, AES_BLOCK_SIZE);
+   }
+   atomic_long_inc(&ebb_sched_batches);
+   atomic_long_add(nr, &ebb_sched_requests);
+
+out:
+   if (req)
+      skcipher_request_free(req);
+   kzfree(blocks);
+   list_for_each_entry_safe(r, tmp, batch, list){
+      list_del(&r->list);                   // r belongs to its waiter once completed
+      r->err = ret;
+      complete(&r->done);
+   }
+}
+
+/// Work function of a queue -- runs whatever is pending once the window expired
+static void ebb_sched_work(struct work_struct *work){
+   struct ebb_sched_queue *q = container_of(work, struct ebb_sched_queue, work);
+   LIST_HEAD(batch);
+   unsigned int nr;
+
+   spin_lock(&q->lock);
+   list_splice_init(&q->pending, &batch);
+   nr = q->nr;
+   q->nr = 0;
+   spin_unlock(&q->lock);
+   if (nr)
+      ebb_sched_run(q, &batch, nr);
+}
+
+/// Timer of a queue -- hands the batch to the module workqueue, the crypto API may sleep
+static enum hrtimer_restart ebb_sched_timer(struct hrtimer *timer){
+   struct ebb_sched_queue *q = container_of(timer, struct ebb_sched_queue, timer);
+
+   queue_work_on(ebb_node_cpu(q->node), ebb_wq, &q->work);
+   return HRTIMER_NORESTART;
+}
+
+/** @brief Prepares a coalescing queue of a new key
+ *  @param q The queue
+ *  @param k The key the queue belongs to
+ *  @param enc 1 for the encryption queue, 0 for the decryption queue
+ */
+static void ebb_sched_queue_init(struct ebb_sched_queue *q, struct ebb_key *k, int enc){
+   spin_lock_init(&q->lock);
+   INIT_LIST_HEAD(&q->pending);
+   q->nr = 0;
+   q->key = k;
+   q->enc = enc;
+   q->node = k->node;
+   hrtimer_init(&q->timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+   q->timer.function = ebb_sched_timer;
+   INIT_WORK(&q->work, ebb_sched_work);
+}
+
+/** @brief Stops the timer and work of a queue. The key is only freed with keys_sem held for
+ *  write, so no request can be pending any more -- only a stale timer or work item.
+ *  @param q The queue
+ */
+static void ebb_sched_queue_stop(struct ebb_sched_queue *q){
+   hrtimer_cancel(&q->timer);
+   cancel_work_sync(&q->work);
+}
+
+/** @brief Queues a single block request and waits for its batch. The request that fills the
+ *  batch runs it right away in its own context, otherwise the first request of a batch arms
+ *  the window timer.
+ *  @param q The queue of the key and direction of the request
+ *  @param r The request
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_sched_submit(struct ebb_sched_queue *q, struct ebb_sched_req *r){
+   LIST_HEAD(batch);
+   unsigned int nr = 0;
+
+   init_completion(&r->done);
+   spin_lock(&q->lock);
+   list_add_tail(&r->list, &q->pending);
+   if (++q->nr >= READ_ONCE(coalesce_batch)){
+      list_splice_init(&q->pending, &batch);
+      nr = q->nr;
+      q->nr = 0;
+      hrtimer_try_to_cancel(&q->timer);
+   }
+   else if (q->nr == 1){
+      hrtimer_start(&q->timer, ns_to_ktime((u64)READ_ONCE(coalesce_window_us) * NSEC_PER_USEC),
+                    HRTIMER_MODE_REL);
+   }
+   spin_unlock(&q->lock);
+
+   if (nr)
+      ebb_sched_run(q, &batch, nr);
+   wait_for_completion(&r->done);
+   return r->err;
+}
+//FIM do AGENDADOR////
+
+//CHAVES E HMAC////
+
+/** @brief Releases the transforms of a key handle
+ *  @param k The key to free, may be NULL
+ */
+static void ebb_key_free(struct ebb_key *k){
+   if (!k)
+      return;
+   if (k->alg == EBB_ALG_AES_CBC){
+      ebb_sched_queue_stop(&k->queue[0]);
+      ebb_sched_queue_stop(&k->queue[1]);
+   }
+   if (k->shash)
+      crypto_free_shash(k->shash);
+   if (k->skcipher)
+      crypto_free_skcipher(k->skcipher);
+   if (k->ecb)
+      crypto_free_skcipher(k->ecb);
+   kzfree(k);
+}
+
+/** @brief Maps an enum ebb_alg to the crypto API name of its keyed transform
+ *  @param alg The algorithm requested by user space
+ *  @return the transform name or NULL if the algorithm is not a MAC
+ */
+static const char *ebb_hmac_name(__u32 alg){
+   switch (alg){
+   case EBB_ALG_HMAC_SHA256:
+      return "hmac(sha256)";
+   case EBB_ALG_HMAC_SHA512:
+      return "hmac(sha512)";
+   default:
+      return NULL;
+   }
+}
+
+/** @brief Looks a key handle up. The caller must hold keys_sem.
+ *  @param session The session owning the handle
+ *  @param handle The handle returned by EBBCHAR_IOC_SETKEY
+ *  @param alg The enum ebb_alg the caller needs, 0 for any
+ *  @return the key or NULL if the handle is not in use or of another algorithm
+ */
+static struct ebb_key *ebb_key_get(struct ebb_session *session, __s32 handle, __u32 alg){
+   struct ebb_key *k;
+
+   if (handle < 0 || handle >= EBB_MAX_KEYS)
+      return NULL;
+   k = session->keys[handle];
+   if (k && alg && k->alg != alg)
+      return NULL;
+   return k;
+}
+
+/** @brief Allocates and keys a skcipher transform
+ *  @param tfm Receives the transform
+ *  @param name The crypto API name of the transform
+ *  @param keybuf The key
+ *  @param keylen The length of the key
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_alloc_skcipher(struct crypto_skcipher **tfm, const char *name,
+                              const u8 *keybuf, unsigned int keylen){
+   struct crypto_skcipher *t;
+
+   t = crypto_alloc_skcipher(name, 0, 0);
+   if (IS_ERR(t)){
+      pr_info("could not allocate skcipher handle %s\n", name);
+      return PTR_ERR(t);
+   }
+   *tfm = t;
+   return crypto_skcipher_setkey(t, keybuf, keylen);
+}
+
+/** @brief Allocates a key and keys its transforms. crypto_shash_setkey() on an hmac()
+ *  transform hashes the ipad and opad blocks once and keeps the partial states, so the per
+ *  message cost is only the message itself plus the two finalizations.
+ *  @param alg The enum ebb_alg of the key
+ *  @param keybuf The key
+ *  @param keylen The length of the key
+ *  @param node The NUMA node of the session, the key is allocated there
+ *  @return the key or an ERR_PTR()
+ */
+static struct ebb_key *ebb_key_alloc(__u32 alg, const u8 *keybuf, unsigned int keylen, int node){
+   struct ebb_key *k;
+   const char *name = ebb_hmac_name(alg);
+   int ret;
+
+   k = kzalloc_node(sizeof(*k), GFP_KERNEL, node);
+   if (!k)
+      return ERR_PTR(-ENOMEM);
+   k->node = node;
+   if (name){
+      k->shash = crypto_alloc_shash(name, 0, 0);
+      if (IS_ERR(k->shash)){
+         pr_info("can't alloc alg %s\n", name);
+         ret = PTR_ERR(k->shash);
+         k->shash = NULL;
+         goto fail;
+      }
+      ret = crypto_shash_setkey(k->shash, keybuf, keylen);
+   }
+   else if (alg == EBB_ALG_AES_CBC){
+      ret = ebb_alloc_skcipher(&k->skcipher, "cbc(aes)", keybuf, keylen);
+      if (!ret)
+         ret = ebb_alloc_skcipher(&k->ecb, "ecb(aes)", keybuf, keylen);
+      if (!ret){
+         ebb_sched_queue_init(&k->queue[0], k, 0);
+         ebb_sched_queue_init(&k->queue[1], k, 1);
+      }
+   }
+   else if (alg == EBB_ALG_AES_CTR){
+      ret = ebb_alloc_skcipher(&k->skcipher, "ctr(aes)", keybuf, keylen);
+   }
+   else if (alg == EBB_ALG_AES_XTS){
+      ret = ebb_alloc_skcipher(&k->skcipher, "xts(aes)", keybuf, keylen);
+   }
+   else {
+      ret = -EINVAL;
+   }
+   if (ret)
+      goto fail;
+   k->alg = alg;
+   return k;
+
+fail:
+   ebb_key_free(k);
+   return ERR_PTR(ret);
+}
+
+/** @brief Handles EBBCHAR_IOC_SETKEY
+ *  @param session The session the handle is created in
+ *  @param uarg User pointer to a struct ebb_setkey
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_setkey(struct ebb_session *session, struct ebb_setkey __user *uarg){
+   struct ebb_setkey arg;
+   struct ebb_key *k;
+   u8 *keybuf;
+   int i, ret = 0;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.keylen == 0 || arg.keylen > EBB_MAX_KEY_SIZE)
+      return -EINVAL;
+   keybuf = memdup_user(u64_to_user_ptr(arg.key), arg.keylen);
+   if (IS_ERR(keybuf))
+      return PTR_ERR(keybuf);
+   k = ebb_key_alloc(arg.alg, keybuf, arg.keylen, session->node);
+   kzfree(keybuf);
+   if (IS_ERR(k))
+      return PTR_ERR(k);
+
+   down_write(&session->keys_sem);
+   for (i = 0; i < EBB_MAX_KEYS && session->keys[i]; i++)
+      ;
+   if (i == EBB_MAX_KEYS)
+      ret = -ENOSPC;
+   else if (put_user(i, &uarg->handle))
+      ret = -EFAULT;
+   else
+      session->keys[i] = k;
+   up_write(&session->keys_sem);
+
+   if (ret)
+      ebb_key_free(k);
+   else
+      printk(KERN_INFO "EBBChar: Created key handle %d for algorithm %u\n", i, arg.alg);
+   return ret;
+}
+
+/** @brief Drops a key handle
+ *  @param session The session owning the handle
+ *  @param handle The handle returned by EBBCHAR_IOC_SETKEY
+ *  @return 0 on success, -EINVAL if the handle is not in use
+ */
+static int ebb_delkey(struct ebb_session *session, __s32 handle){
+   struct ebb_key *k;
+
+   down_write(&session->keys_sem);
+   k = ebb_key_get(session, handle, 0);
+   if (k)
+      session->keys[handle] = NULL;
+   up_write(&session->keys_sem);
+   ebb_key_free(k);
+   return k ? 0 : -EINVAL;
+}
+
+/** @brief Computes the MAC of one user message into arg->mac
+ *  @param session The session owning the key handle
+ *  @param uarg User pointer to a struct ebb_mac
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_mac(struct ebb_session *session, struct ebb_mac __user *uarg){
+   struct ebb_mac arg;
+   struct ebb_key *k;
+   u8 *data;
+   int ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.len > EBB_MAX_MSG_SIZE)
+      return -EINVAL;
+   data = memdup_user(u64_to_user_ptr(arg.data), arg.len);
+   if (IS_ERR(data))
+      return PTR_ERR(data);
+
+   down_read(&session->keys_sem);
+   k = ebb_key_get(session, arg.handle, 0);
+   if (!k || !k->shash){
+      ret = -EINVAL;
+   }
+   else {
+      SHASH_DESC_ON_STACK(desc, k->shash);
+
+      desc->tfm = k->shash;
+      desc->flags = 0x0;
+      ret = crypto_shash_digest(desc, data, arg.len, arg.mac);
+      arg.maclen = crypto_shash_digestsize(k->shash);
+      shash_desc_zero(desc);
+   }
+   up_read(&session->keys_sem);
+   ebb_account(session, arg.len);
+
+   if (!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+      ret = -EFAULT;
+   kfree(data);
+   return ret;
+}
+
+/** @brief Computes the MACs of many messages with one key handle. One descriptor and one bounce
+ *  buffer are used for the whole batch and the MACs are returned with a single copy, so a short
+ *  message costs little more than its hash blocks.
+ *  @param session The session owning the key handle
+ *  @param uarg User pointer to a struct ebb_mac_batch
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_mac_batch(struct ebb_session *session, struct ebb_mac_batch __user *uarg){
+   struct ebb_mac_batch arg;
+   struct ebb_iovec *iov;
+   struct ebb_key *k;
+   unsigned int i, ds, maxlen = 0;
+   u8 *bounce = NULL, *macs = NULL;
+   int ret = 0;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.count == 0 || arg.count > EBB_MAX_BATCH)
+      return -EINVAL;
+   iov = memdup_user(u64_to_user_ptr(arg.msgs), arg.count * sizeof(*iov));
+   if (IS_ERR(iov))
+      return PTR_ERR(iov);
+   for (i = 0; i < arg.count; i++){
+      if (iov[i].len > EBB_MAX_MSG_SIZE){
+         ret = -EINVAL;
+         goto out;
+      }
+      maxlen = max(maxlen, iov[i].len);
+   }
+   bounce = kvmalloc(maxlen ? maxlen : 1, GFP_KERNEL);
+   if (!bounce){
+      ret = -ENOMEM;
+      goto out;
+   }
+
+   down_read(&session->keys_sem);
+   k = ebb_key_get(session, arg.handle, 0);
+   if (!k || !k->shash){
+      ret = -EINVAL;
+      goto out_unlock;
+   }
+   ds = crypto_shash_digestsize(k->shash);
+   macs = kmalloc_array(arg.count, ds, GFP_KERNEL);
+   if (!macs){
+      ret = -ENOMEM;
+      goto out_unlock;
+   }
+   {
+      SHASH_DESC_ON_STACK(desc, k->shash);
+
+      desc->tfm = k->shash;
+      desc->flags = 0x0;
+      for (i = 0; i < arg.count && !ret; i++){
+         if (copy_from_user(bounce, u64_to_user_ptr(iov[i].base), iov[i].len))
+            ret = -EFAULT;
+         else
+            ret = crypto_shash_digest(desc, bounce, iov[i].len, macs + i * ds);
+         ebb_account(session, iov[i].len);
+      }
+      shash_desc_zero(desc);
+   }
+   if (!ret && copy_to_user(u64_to_user_ptr(arg.macs), macs, arg.count * ds))
+      ret = -EFAULT;
+
+out_unlock:
+   up_read(&session->keys_sem);
+out:
+   kfree(macs);
+   kvfree(bounce);
+   kfree(iov);
+   return ret;
+}
+//FIM do HMAC////
+
+//CIFRA COM HANDLE////
+
+#define EBB_CIPHER_CHUNK SZ_64K             ///< Bounce buffer size of the unbatched cipher path
+
+static int ebb_cipher_par(struct ebb_key *k, int enc, struct scatterlist *src, unsigned int src_n,
+                          struct scatterlist *dst, unsigned int dst_n, unsigned int len, u8 *iv);
+static int ebb_cipher_pinned(struct ebb_key *k, int enc, const u8 __user *in, u8 __user *out,
+                             unsigned int len, u8 *iv);
+
+/** @brief Returns the granularity of the requests of a key, AES_BLOCK_SIZE or the XTS data unit
+ *  @param k The AES key
+ */
+static unsigned int ebb_cipher_unit(struct ebb_key *k){
+   return k->alg == EBB_ALG_AES_XTS ? EBB_XTS_SECTOR_SIZE : AES_BLOCK_SIZE;
+}
+
+/** @brief Moves the IV of a CTR or XTS key forward, see struct ebb_cipher for the IV layouts
+ *  @param k The AES key
+ *  @param iv The IV to update
+ *  @param units The blocks (CTR) or data units (XTS) to skip
+ */
+static void ebb_iv_advance(struct ebb_key *k, u8 *iv, u64 units){
+   u64 lo;
+
+   if (k->alg == EBB_ALG_AES_XTS){
+      put_unaligned_le64(get_unaligned_le64(iv) + units, iv);
+      return;
+   }
+   lo = get_unaligned_be64(iv + 8);
+   put_unaligned_be64(lo + units, iv + 8);
+   if (lo + units < lo)                    // carry into the high half of the counter
+      put_unaligned_be64(get_unaligned_be64(iv) + 1, iv);
+}
+
+/** @brief Builds the scatterlist of a range of another scatterlist. A range starting deep inside
+ *  a merged multi-page entry gets the page it starts in and an offset inside that page, since
+ *  sg_miter and sg_pcopy_to_buffer() expect offsets below PAGE_SIZE.
+ *  @param sgl The scatterlist
+ *  @param nents The entries of sgl
+ *  @param offset Start of the range
+ *  @param len Length of the range, the caller checks it is inside sgl
+ *  @param out_n Receives the number of entries
+ *  @return the scatterlist, to be freed with kfree(), or an ERR_PTR()
+ */
+static struct scatterlist *ebb_sg_range(struct scatterlist *sgl, unsigned int nents, u64 offset,
+                                        unsigned int len, unsigned int *out_n){
+   struct scatterlist *sg, *out;
+   unsigned int i, n = 0, skip, start;
+   u64 pos = 0;
+
+   for_each_sg(sgl, sg, nents, i){
+      if (pos + sg->length > offset && pos < offset + len)
+         n++;
+      pos += sg->length;
+   }
+   out = kmalloc_array(n, sizeof(*out), GFP_KERNEL);
+   if (!out)
+      return ERR_PTR(-ENOMEM);
+   sg_init_table(out, n);
+   pos = 0;
+   n = 0;
+   for_each_sg(sgl, sg, nents, i){
+      if (pos + sg->length > offset && pos < offset + len){
+         skip = offset > pos ? offset - pos : 0;
+         start = sg->offset + skip;
+         sg_set_page(&out[n++], nth_page(sg_page(sg), start >> PAGE_SHIFT),
+                     min_t(u64, sg->length - skip, offset + len - pos - skip), offset_in_page(start));
+      }
+      pos += sg->length;
+   }
+   *out_n = n;
+   return out;
+}
+
+/** @brief Runs one skcipher request and waits for it
+ *  @param req The request, its callback set to crypto_req_done() with wait
+ *  @param wait The wait of the request
+ *  @param enc 1 encrypts, 0 decrypts
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_skcipher_run(struct skcipher_request *req, struct crypto_wait *wait, int enc){
+   if (enc)
+      return crypto_wait_req(crypto_skcipher_encrypt(req), wait);
+   return crypto_wait_req(crypto_skcipher_decrypt(req), wait);
+}
+
+/** @brief Runs a cipher operation of an AES key between two scatterlists, iv is updated for the
+ *  next request of the stream. XTS runs one request per data unit, each with its own tweak.
+ *  @param k The AES key
+ *  @param enc 1 encrypts, 0 decrypts
+ *  @param src The input scatterlist
+ *  @param src_n The entries of src
+ *  @param dst The output scatterlist
+ *  @param dst_n The entries of dst
+ *  @param len Length of the data, a multiple of ebb_cipher_unit()
+ *  @param iv The IV, updated on return
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_cipher_sg(struct ebb_key *k, int enc, struct scatterlist *src, unsigned int src_n,
+                         struct scatterlist *dst, unsigned int dst_n, unsigned int len, u8 *iv){
+   struct scatterlist *s, *d;
+   struct skcipher_request *req;
+   DECLARE_CRYPTO_WAIT(wait);
+   u8 next_iv[AES_BLOCK_SIZE];
+   unsigned int off, s_n, d_n;
+   int ret = 0;
+
+   req = skcipher_request_alloc(k->skcipher, GFP_KERNEL);
+   if (!req)
+      return -ENOMEM;
+   skcipher_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG | CRYPTO_TFM_REQ_MAY_SLEEP,
+                                 crypto_req_done, &wait);
+   switch (k->alg){
+   case EBB_ALG_AES_CBC:
+      if (!enc)                            // the input may be overwritten in place
+         sg_pcopy_to_buffer(src, src_n, next_iv, AES_BLOCK_SIZE, len - AES_BLOCK_SIZE);
+      skcipher_request_set_crypt(req, src, dst, len, iv);
+      ret = ebb_skcipher_run(req, &wait, enc);
+      if (!ret && enc)
+         sg_pcopy_to_buffer(dst, dst_n, iv, AES_BLOCK_SIZE, len - AES_BLOCK_SIZE);
+      else if (!ret)
+         memcpy(iv, next_iv, AES_BLOCK_SIZE);
+      break;
+   case EBB_ALG_AES_CTR:
+      memcpy(next_iv, iv, AES_BLOCK_SIZE);  // the template moves the IV it is given
+      skcipher_request_set_crypt(req, src, dst, len, next_iv);
+      ret = ebb_skcipher_run(req, &wait, enc);
+      if (!ret)
+         ebb_iv_advance(k, iv, len / AES_BLOCK_SIZE);
+      break;
+   case EBB_ALG_AES_XTS:
+      for (off = 0; !ret && off < len; off += EBB_XTS_SECTOR_SIZE){
+         s = ebb_sg_range(src, src_n, off, EBB_XTS_SECTOR_SIZE, &s_n);
+         d = IS_ERR(s) ? s : ebb_sg_range(dst, dst_n, off, EBB_XTS_SECTOR_SIZE, &d_n);
+         if (IS_ERR(d)){
+            if (!IS_ERR(s))
+               kfree(s);
+            ret = PTR_ERR(d);
+            break;
+         }
+         memcpy(next_iv, iv, AES_BLOCK_SIZE);
+         skcipher_request_set_crypt(req, s, d, EBB_XTS_SECTOR_SIZE, next_iv);
+         ret = ebb_skcipher_run(req, &wait, enc);
+         if (!ret)
+            ebb_iv_advance(k, iv, 1);
+         kfree(d);
+         kfree(s);
+      }
+      break;
+   default:
+      ret = -EINVAL;
+      break;
+   }
+   skcipher_request_free(req);
+   return ret;
+}
+
+/** @brief Runs a cipher operation of any length on the unbatched transform of a key, through a
+ *  bounce buffer of at most EBB_CIPHER_CHUNK bytes. iv is updated so the caller can continue the
+ *  stream with another request.
+ *  @param k The AES key
+ *  @param enc 1 encrypts, 0 decrypts
+ *  @param in User pointer to the input
+ *  @param out User pointer to the output
+ *  @param len Length of the data, a multiple of ebb_cipher_unit()
+ *  @param iv The IV, updated on return
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_cipher_user(struct ebb_key *k, int enc, const u8 __user *in, u8 __user *out,
+                           unsigned int len, u8 *iv){
+   struct scatterlist sg;
+   unsigned int n, done = 0;
+   u8 *bounce;
+   int ret = 0;
+
+   bounce = kmalloc_node(min_t(unsigned int, len, EBB_CIPHER_CHUNK), GFP_KERNEL, k->node);
+   if (!bounce)
+      return -ENOMEM;
+   while (done < len && !ret){
+      n = min_t(unsigned int, len - done, EBB_CIPHER_CHUNK);
+      if (copy_from_user(bounce, in + done, n)){
+         ret = -EFAULT;
+         break;
+      }
+      sg_init_one(&sg, bounce, n);
+      ret = ebb_cipher_sg(k, enc, &sg, 1, &sg, 1, n, iv);
+      if (!ret && copy_to_user(out + done, bounce, n))
+         ret = -EFAULT;
+      done += n;
+   }
+   kzfree(bounce);
+   return ret;
+}
+
+/** @brief Tells whether a request is split across the CPUs. CBC encryption chains every block
+ *  on the one before, so only its decryption can be split.
+ *  @param k The AES key
+ *  @param enc 1 encrypts, 0 decrypts
+ *  @param len Length of the request
+ */
+static bool ebb_cipher_parallel(struct ebb_key *k, int enc, unsigned int len){
+   unsigned int threshold = READ_ONCE(parallel_threshold);
+
+   if (!threshold || len < threshold || num_online_cpus() < 2)
+      return false;
+   return k->alg != EBB_ALG_AES_CBC || !enc;
+}
+
+/** @brief Handles EBBCHAR_IOC_CIPHER. Single block CBC requests go through the coalescing
+ *  queue of their key and direction when coalesce_batch > 1, large parallelizable requests are
+ *  split across the CPUs, everything else runs unbatched on the calling CPU.
+ *  @param session The session owning the key handle
+ *  @param uarg User pointer to a struct ebb_cipher
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_cipher(struct ebb_session *session, struct ebb_cipher __user *uarg){
+   struct ebb_cipher arg;
+   struct ebb_sched_req r;
+   struct ebb_key *k;
+   int enc, ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.op != EBB_OP_ENCRYPT && arg.op != EBB_OP_DECRYPT)
+      return -EINVAL;
+   if (arg.len == 0 || arg.len % AES_BLOCK_SIZE || arg.len > EBB_MAX_CIPHER_SIZE)
+      return -EINVAL;
+   enc = (arg.op == EBB_OP_ENCRYPT);
+
+   down_read(&session->keys_sem);
+   k = ebb_key_get(session, arg.handle, 0);
+   if (!k || !k->skcipher || arg.len % ebb_cipher_unit(k)){
+      ret = -EINVAL;
+   }
+   else if (arg.len == AES_BLOCK_SIZE && k->alg == EBB_ALG_AES_CBC &&
+            READ_ONCE(coalesce_batch) > 1){
+      if (copy_from_user(r.block, u64_to_user_ptr(arg.in), AES_BLOCK_SIZE)){
+         ret = -EFAULT;
+      }
+      else {
+         u8 in_block[AES_BLOCK_SIZE];
+
+         memcpy(in_block, r.block, AES_BLOCK_SIZE);
+         memcpy(r.iv, arg.iv, AES_BLOCK_SIZE);
+         ret = ebb_sched_submit(&k->queue[enc], &r);
+         if (!ret && copy_to_user(u64_to_user_ptr(arg.out), r.block, AES_BLOCK_SIZE))
+            ret = -EFAULT;
+         memcpy(arg.iv, enc ? r.block : in_block, AES_BLOCK_SIZE);
+      }
+   }
+   else if (ebb_cipher_parallel(k, enc, arg.len)){
+      ret = ebb_cipher_pinned(k, enc, u64_to_user_ptr(arg.in), u64_to_user_ptr(arg.out),
+                              arg.len, arg.iv);
+   }
+   else {
+      ret = ebb_cipher_user(k, enc, u64_to_user_ptr(arg.in), u64_to_user_ptr(arg.out),
+                            arg.len, arg.iv);
+   }
+   up_read(&session->keys_sem);
+   ebb_account(session, arg.len);
+
+   if (!ret && copy_to_user(uarg->iv, arg.iv, AES_BLOCK_SIZE))
+      ret = -EFAULT;
+   return ret;
+}
+//FIM da CIFRA COM HANDLE////
+
+//CHECKSUMS////
+
+/** @brief Tells whether an algorithm is one of the non-cryptographic checksums
+ *  @param alg The algorithm requested by user space
+ */
+static bool ebb_is_checksum(__u32 alg){
+   return alg == EBB_ALG_CRC32C || alg == EBB_ALG_XXH64;
+}
+
+/** @brief Checksums a kernel buffer with the library functions, no transform is allocated.
+ *  crc32c() runs on the SSE4.2/ARMv8 CRC instructions where the CPU has them. The result is
+ *  stored little endian, the same bytes the crc32c and xxhash64 shash transforms return.
+ *  @param alg EBB_ALG_CRC32C or EBB_ALG_XXH64
+ *  @param data The buffer
+ *  @param len Length of the buffer
+ *  @param digest Receives the checksum
+ *  @return the checksum size
+ */
+static unsigned int ebb_checksum(__u32 alg, const u8 *data, unsigned int len, u8 *digest){
+   if (alg == EBB_ALG_CRC32C){
+      put_unaligned_le32(~crc32c(~0, data, len), digest);
+      return sizeof(u32);
+   }
+   put_unaligned_le64(xxh64(data, len, 0), digest);
+   return sizeof(u64);
+}
+
+/* The kernel only has the xxhash64 library, so the module registers it as a shash of its own
+ * for the streaming, file, registered buffer and tree digests, which all run on shash. */
+static int ebb_xxh64_init(struct shash_desc *desc){
+   xxh64_reset(shash_desc_ctx(desc), 0);
+   return 0;
+}
+
+static int ebb_xxh64_update(struct shash_desc *desc, const u8 *data, unsigned int len){
+   return xxh64_update(shash_desc_ctx(desc), data, len);
+}
+
+static int ebb_xxh64_final(struct shash_desc *desc, u8 *out){
+   put_unaligned_le64(xxh64_digest(shash_desc_ctx(desc)), out);
+   return 0;
+}
+
+static struct shash_alg ebb_xxh64_alg = {
+   .digestsize = sizeof(u64),
+   .init = ebb_xxh64_init,
+   .update = ebb_xxh64_update,
+   .final = ebb_xxh64_final,
+   .descsize = sizeof(struct xxh64_state),
+   .base = {
+      .cra_name = "xxhash64",
+      .cra_driver_name = "xxhash64-ebbchar",
+      .cra_priority = 100,
+      .cra_blocksize = 1,
+      .cra_module = THIS_MODULE,
+   },
+};
+//FIM dos CHECKSUMS////
+
+//CACHE DE DIGEST////
+
+/// What the fingerprint of a cache entry was taken from
+enum ebb_cache_kind {
+   EBB_CACHE_DATA = 1,                      ///< fp is the xxhash64 of the content with two seeds
+   EBB_CACHE_FILE = 2,                      ///< fp is the (inode, device) of a file
+};
+
+/// Lookup key of the digest cache, compared with memcmp() so it must stay padding free
+struct ebb_cache_key {
+   u64 fp[2];                               ///< Content fingerprint or file identity
+   u64 len;                                 ///< Length of the content or size of the file
+   u64 mtime;                               ///< mtime in ns of a file, 0 for content
+   u64 ctime;                               ///< ctime in ns of a file, 0 for content
+   u32 alg;                                 ///< enum ebb_alg of the digest
+   u32 kind;                                ///< enum ebb_cache_kind
+   u32 generation;                          ///< i_generation of a file, 0 for content
+   u32 pad;
+};
+
+/// One cached digest, on the hash table and on the LRU list
+struct ebb_cache_entry {
+   struct hlist_node node;                  ///< Link in ebb_cache
+   struct list_head lru;                    ///< Link in ebb_cache_lru, most recently used first
+   struct ebb_cache_key key;
+   unsigned int digestlen;
+   u8 digest[EBB_MAX_DIGEST_SIZE];
+};
+
+static DEFINE_HASHTABLE(ebb_cache, 10);     ///< Buckets of the digest cache
+static LIST_HEAD(ebb_cache_lru);            ///< Entries of the cache in LRU order
+static DEFINE_SPINLOCK(ebb_cache_lock);     ///< Protects ebb_cache, ebb_cache_lru and ebb_cache_count
+
+/** @brief Maps an unkeyed enum ebb_alg to the crypto API name of its hash
+ *  @param alg The algorithm requested by user space
+ *  @param digestlen Returns the digest size of the algorithm
+ *  @return the hash name or NULL if the algorithm is not an unkeyed digest
+ */
+static const char *ebb_hash_name(__u32 alg, unsigned int *digestlen){
+   switch (alg){
+   case EBB_ALG_SHA1:
+      *digestlen = SHA1_DIGEST_SIZE;
+      return "sha1";
+   case EBB_ALG_SHA256:
+      *digestlen = SHA256_DIGEST_SIZE;
+      return "sha256";
+   case EBB_ALG_SHA512:
+      *digestlen = SHA512_DIGEST_SIZE;
+      return "sha512";
+   case EBB_ALG_CRC32C:
+      *digestlen = sizeof(u32);
+      return "crc32c";
+   case EBB_ALG_XXH64:
+      *digestlen = sizeof(u64);
+      return "xxhash64";
+   default:
+      return NULL;
+   }
+}
+
+/** @brief Finds a cache entry and copies its digest out. A hit moves the entry to the head of
+ *  the LRU list. The hit/miss counters are only updated while the cache is enabled.
+ *  @param key The key to look up
+ *  @param digest Receives the cached digest on a hit
+ *  @return true on a hit
+ */
+static bool ebb_cache_lookup(const struct ebb_cache_key *key, u8 *digest){
+   struct ebb_cache_entry *e;
+   bool hit = false;
+
+   if (!cache_entries)
+      return false;
+   spin_lock(&ebb_cache_lock);
+   hash_for_each_possible(ebb_cache, e, node, key->fp[0] ^ key->alg){
+      if (!memcmp(&e->key, key, sizeof(*key))){
+         memcpy(digest, e->digest, e->digestlen);
+         list_move(&e->lru, &ebb_cache_lru);
+         hit = true;
+         break;
+      }
+   }
+   spin_unlock(&ebb_cache_lock);
+   atomic_long_inc(hit ? &ebb_cache_hits : &ebb_cache_misses);
+   return hit;
+}
+
+/** @brief Evicts up to nr entries from the tail of the LRU list. Called with ebb_cache_lock
+ *  held, the entries are moved to dispose so they can be freed after the lock is dropped.
+ *  @param nr The number of entries to evict
+ *  @param dispose List receiving the evicted entries
+ *  @return the number of entries evicted
+ */
+static unsigned long ebb_cache_evict(unsigned long nr, struct list_head *dispose){
+   struct ebb_cache_entry *e;
+   unsigned long freed = 0;
+
+   while (freed < nr && !list_empty(&ebb_cache_lru)){
+      e = list_last_entry(&ebb_cache_lru, struct ebb_cache_entry, lru);
+      hash_del(&e->node);
+      list_move(&e->lru, dispose);
+      ebb_cache_count--;
+      freed++;
+   }
+   return freed;
+}
+
+/** @brief Frees the entries of a dispose list filled by ebb_cache_evict()
+ *  @param dispose The list of evicted entries
+ */
+static void ebb_cache_dispose(struct list_head *dispose){
+   struct ebb_cache_entry *e, *tmp;
+
+   list_for_each_entry_safe(e, tmp, dispose, lru)
+      kfree(e);
+}
+
+/** @brief Stores a freshly computed digest, evicting from the LRU tail to stay within
+ *  cache_entries. A failed allocation only means the digest is not cached.
+ *  @param key The key of the digest
+ *  @param digest The digest
+ *  @param digestlen The length of the digest
+ */
+static void ebb_cache_insert(const struct ebb_cache_key *key, const u8 *digest,
+                             unsigned int digestlen){
+   struct ebb_cache_entry *e, *old;
+   LIST_HEAD(dispose);
+
+   if (!cache_entries)
+      return;
+   e = kmalloc(sizeof(*e), GFP_KERNEL);
+   if (!e)
+      return;
+   e->key = *key;
+   e->digestlen = digestlen;
+   memcpy(e->digest, digest, digestlen);
+
+   spin_lock(&ebb_cache_lock);
+   hash_for_each_possible(ebb_cache, old, node, key->fp[0] ^ key->alg){
+      if (!memcmp(&old->key, key, sizeof(*key))){     // raced with another insert of the same key
+         spin_unlock(&ebb_cache_lock);
+         kfree(e);
+         return;
+      }
+   }
+   hash_add(ebb_cache, &e->node, key->fp[0] ^ key->alg);
+   list_add(&e->lru, &ebb_cache_lru);
+   ebb_cache_count++;
+   if (ebb_cache_count > cache_entries)
+      ebb_cache_evict(ebb_cache_count - cache_entries, &dispose);
+   spin_unlock(&ebb_cache_lock);
+   ebb_cache_dispose(&dispose);
+}
 
+/** @brief Drops every entry of the cache, used when the module is unloaded */
+static void ebb_cache_flush(void){
+   LIST_HEAD(dispose);
+
+   spin_lock(&ebb_cache_lock);
+   ebb_cache_evict(ULONG_MAX, &dispose);
+   spin_unlock(&ebb_cache_lock);
+   ebb_cache_dispose(&dispose);
+}
+
+/// Shrinker callback -- reports how many entries could be freed under memory pressure
+static unsigned long ebb_cache_shrink_count(struct shrinker *s, struct shrink_control *sc){
+   return READ_ONCE(ebb_cache_count);
+}
+
+/// Shrinker callback -- frees the least recently used entries
+static unsigned long ebb_cache_shrink_scan(struct shrinker *s, struct shrink_control *sc){
+   unsigned long freed;
+   LIST_HEAD(dispose);
+
+   spin_lock(&ebb_cache_lock);
+   freed = ebb_cache_evict(sc->nr_to_scan, &dispose);
+   spin_unlock(&ebb_cache_lock);
+   ebb_cache_dispose(&dispose);
+   return freed;
+}
+
+static struct shrinker ebb_cache_shrinker = {
+   .count_objects = ebb_cache_shrink_count,
+   .scan_objects = ebb_cache_shrink_scan,
+   .seeks = DEFAULT_SEEKS,
+};
+
+/** @brief Digests a kernel buffer going through the cache first. This is the path of the 'h'
+ *  command and of EBBCHAR_IOC_HASH.
+ *  @param alg The unkeyed enum ebb_alg to use
+ *  @param data The buffer to digest
+ *  @param datalen The length of the buffer
+ *  @param digest Receives the digest
+ *  @param hash_len Receives the length of the digest
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_cached_hash(__u32 alg, const unsigned char *data, unsigned int datalen,
+                           unsigned char *digest, unsigned int *hash_len){
+   struct ebb_cache_key key = { .len = datalen, .alg = alg, .kind = EBB_CACHE_DATA };
+   const char *name;
+   unsigned int descsize;
+   int ret;
+
+   name = ebb_hash_name(alg, hash_len);
+   if (!name)
+      return -EINVAL;
+   if (ebb_is_checksum(alg)){               // cheaper than the fingerprint of the cache
+      ebb_checksum(alg, data, datalen, digest);
+      return 0;
+   }
+   if (cache_entries){
+      // xxhash64 is not collision resistant: with public seeds a client could craft two inputs
+      // sharing a fingerprint and be served the digest of the other one, so the seeds are secret
+      key.fp[0] = xxh64(data, datalen, ebb_cache_seed[0]);
+      key.fp[1] = xxh64(data, datalen, ebb_cache_seed[1]);
+      if (ebb_cache_lookup(&key, digest))
+         return 0;
+   }
+   ret = test_hash(name, data, datalen, digest, &descsize);
+   if (!ret)
+      ebb_cache_insert(&key, digest, *hash_len);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_hash(struct ebb_session *session, struct ebb_hash __user *uarg){
+   struct ebb_hash arg;
+   u8 *data;
+   int ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.len > EBB_MAX_HASH_SIZE)
+      return -EINVAL;
+   data = kvmalloc(arg.len ? arg.len : 1, GFP_KERNEL);
+   if (!data)
+      return -ENOMEM;
+   if (copy_from_user(data, u64_to_user_ptr(arg.data), arg.len))
+      ret = -EFAULT;
+   else
+      ret = ebb_cached_hash(arg.alg, data, arg.len, arg.digest, &arg.digestlen);
+   ebb_account(session, arg.len);
+   if (!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+      ret = -EFAULT;
+   kvfree(data);
+   return ret;
+}
+
+/** @brief Fills the cache key identifying the current version of a file. mtime alone is not
+ *  enough since user space can set it back after rewriting a file; any write or utimensat()
+ *  also moves ctime, which only the kernel sets.
+ *  @param key The key to fill
+ *  @param inode The inode of the file
+ *  @param alg The digest the key is for
+ */
+static void ebb_cache_file_key(struct ebb_cache_key *key, struct inode *inode, __u32 alg){
+   memset(key, 0, sizeof(*key));
+   key->fp[0] = inode->i_ino;
+   key->fp[1] = inode->i_sb->s_dev;
+   key->len = i_size_read(inode);
+   key->mtime = (u64)inode->i_mtime.tv_sec * NSEC_PER_SEC + inode->i_mtime.tv_nsec;
+   key->ctime = (u64)inode->i_ctime.tv_sec * NSEC_PER_SEC + inode->i_ctime.tv_nsec;
+   key->generation = inode->i_generation;
+   key->alg = alg;
+   key->kind = EBB_CACHE_FILE;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH_FD -- digests a regular file read in 64KiB chunks. The
+ *  result is only cached if the file identity did not change while it was being read, and
+ *  never for a checksum, which costs less to compute again than a cache entry.
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash_fd
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_hash_fd(struct ebb_session *session, struct ebb_hash_fd __user *uarg){
+   struct ebb_hash_fd arg;
+   struct ebb_cache_key key, after;
+   struct crypto_shash *alg;
+   struct shash_desc *sdesc = NULL;
+   struct inode *inode;
+   struct fd f;
+   const char *name;
+   unsigned int descsize;
+   loff_t pos = 0;
+   ssize_t n = 0;
+   u8 *chunk = NULL;
+   bool cache;
+   int ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   cache = !ebb_is_checksum(arg.alg);
+   name = ebb_hash_name(arg.alg, &arg.digestlen);
+   if (!name)
+      return -EINVAL;
+   f = fdget(arg.fd);
+   if (!f.file)
+      return -EBADF;
+   inode = file_inode(f.file);
+   if (!S_ISREG(inode->i_mode) || !(f.file->f_mode & FMODE_READ)){
+      ret = -EINVAL;
+      goto out_put;
+   }
+
+   ebb_cache_file_key(&key, inode, arg.alg);
+   if (cache && ebb_cache_lookup(&key, arg.digest)){
+      ret = 0;
+      goto out_copy;
+   }
+
+   alg = crypto_alloc_shash(name, CRYPTO_ALG_TYPE_SHASH, 0);
+   if (IS_ERR(alg)){
+      pr_info("can't alloc alg %s\n", name);
+      ret = PTR_ERR(alg);
+      goto out_put;
+   }
+   chunk = kvmalloc(SZ_64K, GFP_KERNEL);
+   sdesc = config_sdesc(alg, &descsize);
+   if (!chunk || IS_ERR(sdesc)){
+      ret = -ENOMEM;
+      goto out_free;
+   }
+   ret = crypto_shash_init(sdesc);
+   while (!ret && (n = kernel_read(f.file, chunk, SZ_64K, &pos)) > 0)
+      ret = crypto_shash_update(sdesc, chunk, n);
+   if (!ret && n < 0)
+      ret = n;
+   if (!ret)
+      ret = crypto_shash_final(sdesc, arg.digest);
+   if (!ret && cache){
+      ebb_cache_file_key(&after, inode, arg.alg);
+      if (!memcmp(&key, &after, sizeof(key)) && pos == key.len)
+         ebb_cache_insert(&key, arg.digest, arg.digestlen);
+   }
+
+out_free:
+   if (!IS_ERR_OR_NULL(sdesc))
+      kfree(sdesc);
+   kvfree(chunk);
+   crypto_free_shash(alg);
+   if (ret)
+      goto out_put;
+out_copy:
+   if (copy_to_user(uarg, &arg, sizeof(arg)))
+      ret = -EFAULT;
+out_put:
+   fdput(f);
+   ebb_account(session, pos);
+   return ret;
+}
+//FIM do CACHE////
+
+//HASH EM STREAMING////
+
+/** @brief Drops the streaming hash state of a session. The caller must hold stream_lock.
+ *  @param session The session
+ */
+static void ebb_stream_reset(struct ebb_session *session){
+   if (session->stream){
+      shash_desc_zero(session->stream);
+      kfree(session->stream);
+   }
+   if (session->stream_tfm)
+      crypto_free_shash(session->stream_tfm);
+   session->stream = NULL;
+   session->stream_tfm = NULL;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH_INIT -- starts a new streaming digest, dropping the
+ *  previous one if it was never finalized
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash, only alg is used
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_stream_init(struct ebb_session *session, struct ebb_hash __user *uarg){
+   struct crypto_shash *alg;
+   struct shash_desc *sdesc;
+   const char *name;
+   unsigned int digestlen, descsize;
+   __u32 id;
+   int ret;
+
+   if (get_user(id, &uarg->alg))
+      return -EFAULT;
+   name = ebb_hash_name(id, &digestlen);
+   if (!name)
+      return -EINVAL;
+   alg = crypto_alloc_shash(name, CRYPTO_ALG_TYPE_SHASH, 0);
+   if (IS_ERR(alg)){
+      pr_info("can't alloc alg %s\n", name);
+      return PTR_ERR(alg);
+   }
+   sdesc = config_sdesc(alg, &descsize);
+   if (IS_ERR(sdesc)){
+      crypto_free_shash(alg);
+      return PTR_ERR(sdesc);
+   }
+   ret = crypto_shash_init(sdesc);
+
+   mutex_lock(&session->stream_lock);
+   ebb_stream_reset(session);
+   session->stream = sdesc;
+   session->stream_tfm = alg;
+   if (ret)
+      ebb_stream_reset(session);
+   mutex_unlock(&session->stream_lock);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH_UPDATE -- feeds data into the streaming digest
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash, only data and len are used
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_stream_update(struct ebb_session *session, struct ebb_hash __user *uarg){
+   struct ebb_hash arg;
+   unsigned int n, done = 0;
+   u8 *bounce;
+   int ret = 0;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   bounce = kmalloc_node(min_t(unsigned int, max(arg.len, 1U), SZ_64K), GFP_KERNEL, session->node);
+   if (!bounce)
+      return -ENOMEM;
+
+   mutex_lock(&session->stream_lock);
+   if (!session->stream)
+      ret = -EINVAL;
+   while (!ret && done < arg.len){
+      n = min_t(unsigned int, arg.len - done, SZ_64K);
+      if (copy_from_user(bounce, u64_to_user_ptr(arg.data) + done, n))
+         ret = -EFAULT;
+      else
+         ret = crypto_shash_update(session->stream, bounce, n);
+      done += n;
+   }
+   mutex_unlock(&session->stream_lock);
+   ebb_account(session, done);
+   kfree(bounce);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH_FINAL -- returns the streaming digest and drops the state
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash, digest and digestlen are returned
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_stream_final(struct ebb_session *session, struct ebb_hash __user *uarg){
+   struct ebb_hash arg;
+   int ret;
+
+   memset(&arg, 0, sizeof(arg));
+   mutex_lock(&session->stream_lock);
+   if (!session->stream){
+      ret = -EINVAL;
+   }
+   else {
+      arg.digestlen = crypto_shash_digestsize(session->stream_tfm);
+      ret = crypto_shash_final(session->stream, arg.digest);
+      ebb_stream_reset(session);
+   }
+   mutex_unlock(&session->stream_lock);
+
+   if (!ret && (put_user(arg.digestlen, &uarg->digestlen) ||
+                copy_to_user(uarg->digest, arg.digest, arg.digestlen)))
+      ret = -EFAULT;
+   return ret;
+}
+//FIM do HASH EM STREAMING////
+
+//BUFFERS REGISTRADOS////
+
+/** @brief Unpins one buffer and frees its scatterlist. Writable pages are dirtied since a
+ *  cipher may have written to them.
+ *  @param b The buffer
+ */
+static void ebb_fixed_unpin(struct ebb_fixed_buf *b){
+   unsigned int i;
+
+   sg_free_table(&b->sgt);
+   for (i = 0; i < b->nr_pages; i++){
+      if (b->write)
+         set_page_dirty_lock(b->pages[i]);
+      put_page(b->pages[i]);
+   }
+   kvfree(b->pages);
+}
+
+/** @brief Unpins and frees the registered buffers of a session. The caller must hold bufs_sem
+ *  for write.
+ *  @param session The session
+ */
+static void ebb_fixed_release(struct ebb_session *session){
+   unsigned int i;
+
+   for (i = 0; i < session->nr_bufs; i++)
+      ebb_fixed_unpin(&session->bufs[i]);
+   if (session->pinned_mm){
+      down_write(&session->pinned_mm->mmap_sem);
+      session->pinned_mm->pinned_vm -= session->pinned;
+      up_write(&session->pinned_mm->mmap_sem);
+      mmdrop(session->pinned_mm);
+      session->pinned_mm = NULL;
+   }
+   atomic_long_sub(session->pinned, &ebb_pinned_pages);
+   kfree(session->bufs);
+   session->bufs = NULL;
+   session->nr_bufs = 0;
+   session->pinned = 0;
+}
+
+/** @brief Charges the pages of a registration to the pinned_vm of the calling process, as
+ *  ib_umem and vfio do, so RLIMIT_MEMLOCK bounds everything the process has pinned rather than
+ *  each registration on its own. ebb_fixed_release() takes the charge back.
+ *  @param session The session
+ *  @param pages The pages to charge
+ *  @return 0 on success, -ENOMEM if RLIMIT_MEMLOCK would be exceeded (unless CAP_IPC_LOCK)
+ */
+static int ebb_fixed_charge(struct ebb_session *session, unsigned long pages){
+   struct mm_struct *mm = current->mm;
+   int ret = 0;
+
+   down_write(&mm->mmap_sem);
+   if (!capable(CAP_IPC_LOCK) && mm->pinned_vm + pages > (rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT))
+      ret = -ENOMEM;
+   else
+      mm->pinned_vm += pages;
+   up_write(&mm->mmap_sem);
+   if (!ret){
+      mmgrab(mm);                           // the last close may come from another process
+      session->pinned_mm = mm;
+   }
+   return ret;
+}
+
+/** @brief Pins one user buffer and builds its scatterlist. Physically contiguous pages (e.g. of
+ *  a huge page) are merged into a single scatterlist entry.
+ *  @param b The buffer to fill
+ *  @param base User address of the buffer
+ *  @param len Length of the buffer
+ *  @param write Nonzero if the device writes to the buffer
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_fixed_pin(struct ebb_fixed_buf *b, unsigned long base, unsigned int len, int write){
+   unsigned int nr = ((base + len - 1) >> PAGE_SHIFT) - (base >> PAGE_SHIFT) + 1;
+   int pinned, ret, i;
+
+   b->pages = kvmalloc_array(nr, sizeof(struct page *), GFP_KERNEL);
+   if (!b->pages)
+      return -ENOMEM;
+   pinned = get_user_pages_fast(base & PAGE_MASK, nr, write, b->pages);
+   if (pinned == nr)
+      ret = sg_alloc_table_from_pages(&b->sgt, b->pages, nr, offset_in_page(base), len,
+                                      GFP_KERNEL);
+   else
+      ret = pinned < 0 ? pinned : -EFAULT;
+   if (ret){
+      for (i = 0; i < pinned; i++)
+         put_page(b->pages[i]);
+      kvfree(b->pages);
+      b->pages = NULL;
+      return ret;
+   }
+   b->nr_pages = nr;
+   b->len = len;
+   b->write = write;
+   return 0;
+}
+
+/** @brief Handles EBBCHAR_IOC_REGISTER_BUFFERS
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_register
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_register_buffers(struct ebb_session *session, struct ebb_register __user *uarg){
+   struct ebb_register arg;
+   struct ebb_iovec *iov;
+   unsigned long total = 0;
+   unsigned int i;
+   int ret = 0;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.count == 0 || arg.count > EBB_MAX_FIXED_BUFS)
+      return -EINVAL;
+   iov = memdup_user(u64_to_user_ptr(arg.iovs), arg.count * sizeof(*iov));
+   if (IS_ERR(iov))
+      return PTR_ERR(iov);
+   for (i = 0; i < arg.count; i++){
+      if (iov[i].len == 0 || iov[i].base + iov[i].len < iov[i].base ||
+          (iov[i].flags & ~EBB_IOV_READONLY)){
+         ret = -EINVAL;
+         goto out;
+      }
+      total += ((iov[i].base + iov[i].len - 1) >> PAGE_SHIFT) - (iov[i].base >> PAGE_SHIFT) + 1;
+   }
+
+   down_write(&session->bufs_sem);
+   if (session->bufs){
+      ret = -EBUSY;
+      goto out_unlock;
+   }
+   if (atomic_long_add_return(total, &ebb_pinned_pages) >
+       ((unsigned long)fixed_max_mb << (20 - PAGE_SHIFT))){
+      atomic_long_sub(total, &ebb_pinned_pages);
+      ret = -ENOMEM;
+      goto out_unlock;
+   }
+   session->pinned = total;
+   ret = ebb_fixed_charge(session, total);
+   if (!ret){
+      session->bufs = kcalloc(arg.count, sizeof(*session->bufs), GFP_KERNEL);
+      if (!session->bufs)
+         ret = -ENOMEM;
+   }
+   for (i = 0; !ret && i < arg.count; i++){
+      ret = ebb_fixed_pin(&session->bufs[i], iov[i].base, iov[i].len,
+                          !(iov[i].flags & EBB_IOV_READONLY));
+      if (!ret)
+         session->nr_bufs++;
+   }
+   if (ret)
+      ebb_fixed_release(session);
+   else
+      printk(KERN_INFO "EBBChar: Registered %u buffers (%lu pages)\n", arg.count, total);
+
+out_unlock:
+   up_write(&session->bufs_sem);
+out:
+   kfree(iov);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_UNREGISTER_BUFFERS, waits for the fixed operations in flight
+ *  @param session The session
+ *  @return 0 on success, -EINVAL if no buffers are registered
+ */
+static int ebb_unregister_buffers(struct ebb_session *session){
+   int ret = 0;
+
+   down_write(&session->bufs_sem);
+   if (session->bufs)
+      ebb_fixed_release(session);
+   else
+      ret = -EINVAL;
+   up_write(&session->bufs_sem);
+   return ret;
+}
+
+/** @brief Builds the scatterlist of a range of a registered buffer from its prebuilt table
+ *  @param b The registered buffer
+ *  @param offset Start of the range
+ *  @param len Length of the range
+ *  @param nents Receives the number of entries
+ *  @return the scatterlist, to be freed with kfree(), or an ERR_PTR()
+ */
+static struct scatterlist *ebb_fixed_sg(struct ebb_fixed_buf *b, u64 offset, unsigned int len,
+                                        unsigned int *nents){
+   if (len == 0 || offset > b->len || len > b->len - offset)
+      return ERR_PTR(-EINVAL);
+   return ebb_sg_range(b->sgt.sgl, b->sgt.nents, offset, len, nents);
+}
+
+/** @brief Digests a scatterlist with a (keyed or unkeyed) shash, one mapped page at a time
+ *  @param tfm The hash transform
+ *  @param sgl The scatterlist
+ *  @param nents The entries of sgl
+ *  @param out Receives the digest
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_shash_sg(struct crypto_shash *tfm, struct scatterlist *sgl, unsigned int nents,
+                        u8 *out){
+   struct sg_mapping_iter miter;
+   SHASH_DESC_ON_STACK(desc, tfm);
+   int ret;
+
+   desc->tfm = tfm;
+   desc->flags = 0x0;
+   ret = crypto_shash_init(desc);
+   sg_miter_start(&miter, sgl, nents, SG_MITER_FROM_SG);
+   while (!ret && sg_miter_next(&miter))
+      ret = crypto_shash_update(desc, miter.addr, miter.length);
+   sg_miter_stop(&miter);
+   if (!ret)
+      ret = crypto_shash_final(desc, out);
+   shash_desc_zero(desc);
+   return ret;
+}
+
+/** @brief Returns the transform of an unkeyed digest for EBB_OP_HASH. It is allocated on first
+ *  use and kept until the device is closed; a shash keeps its state in the descriptor, so the
+ *  fixed operations of the session share it. It is kept per session and not by the module
+ *  because a transform of the xxhash64 the module registers would keep the module loaded.
+ *  @param session The session
+ *  @param alg The algorithm requested by user space
+ *  @param digestlen Returns the digest size of the algorithm
+ *  @return the transform or an ERR_PTR()
+ */
+static struct crypto_shash *ebb_fixed_shash(struct ebb_session *session, __u32 alg,
+                                            unsigned int *digestlen){
+   struct crypto_shash *tfm, *old;
+   const char *name = ebb_hash_name(alg, digestlen);
+
+   if (!name || alg >= ARRAY_SIZE(session->fixed_tfm))
+      return ERR_PTR(-EINVAL);
+   tfm = READ_ONCE(session->fixed_tfm[alg]);
+   if (tfm)
+      return tfm;
+   tfm = crypto_alloc_shash(name, CRYPTO_ALG_TYPE_SHASH, 0);
+   if (IS_ERR(tfm))
+      return tfm;
+   old = cmpxchg(&session->fixed_tfm[alg], NULL, tfm);
+   if (old){                                // another fixed operation allocated it first
+      crypto_free_shash(tfm);
+      tfm = old;
+   }
+   return tfm;
+}
+
+/** @brief Handles EBBCHAR_IOC_FIXED -- runs an operation directly on registered buffers
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_fixed_op
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_fixed(struct ebb_session *session, struct ebb_fixed_op __user *uarg){
+   struct ebb_fixed_op arg;
+   struct scatterlist *src = NULL, *dst = NULL;
+   struct crypto_shash *alg;
+   struct ebb_key *k;
+   unsigned int src_n, dst_n;
+   int enc, ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+
+   down_read(&session->bufs_sem);
+   if (arg.index >= session->nr_bufs){
+      ret = -EINVAL;
+      goto out;
+   }
+   src = ebb_fixed_sg(&session->bufs[arg.index], arg.offset, arg.len, &src_n);
+   if (IS_ERR(src)){
+      ret = PTR_ERR(src);
+      src = NULL;
+      goto out;
+   }
+
+   switch (arg.op){
+   case EBB_OP_ENCRYPT:
+   case EBB_OP_DECRYPT:
+      if (arg.out_index >= session->nr_bufs){
+         ret = -EINVAL;
+         break;
+      }
+      if (!session->bufs[arg.out_index].write){
+         ret = -EACCES;                     // pinned without write access
+         break;
+      }
+      dst = ebb_fixed_sg(&session->bufs[arg.out_index], arg.out_offset, arg.len, &dst_n);
+      if (IS_ERR(dst)){
+         ret = PTR_ERR(dst);
+         dst = NULL;
+         break;
+      }
+      enc = (arg.op == EBB_OP_ENCRYPT);
+      down_read(&session->keys_sem);
+      k = ebb_key_get(session, arg.handle, 0);
+      if (!k || !k->skcipher || arg.len % ebb_cipher_unit(k))
+         ret = -EINVAL;
+      else if (ebb_cipher_parallel(k, enc, arg.len))
+         ret = ebb_cipher_par(k, enc, src, src_n, dst, dst_n, arg.len, arg.iv);
+      else
+         ret = ebb_cipher_sg(k, enc, src, src_n, dst, dst_n, arg.len, arg.iv);
+      up_read(&session->keys_sem);
+      break;
+   case EBB_OP_HASH:
+      alg = ebb_fixed_shash(session, arg.alg, &arg.digestlen);
+      if (IS_ERR(alg))
+         ret = PTR_ERR(alg);
+      else
+         ret = ebb_shash_sg(alg, src, src_n, arg.digest);
+      break;
+   case EBB_OP_MAC:
+      down_read(&session->keys_sem);
+      k = ebb_key_get(session, arg.handle, 0);
+      if (k && k->shash){
+         arg.digestlen = crypto_shash_digestsize(k->shash);
+         ret = ebb_shash_sg(k->shash, src, src_n, arg.digest);
+      }
+      else
+         ret = -EINVAL;
+      up_read(&session->keys_sem);
+      break;
+   default:
+      ret = -EINVAL;
+      break;
+   }
+
+out:
+   up_read(&session->bufs_sem);
+   ebb_account(session, arg.len);
+   kfree(dst);
+   kfree(src);
+   if (!ret && copy_to_user(uarg, &arg, sizeof(arg)))
+      ret = -EFAULT;
+   return ret;
+}
+//FIM dos BUFFERS REGISTRADOS////
+
+//CIFRA PARALELA////
+
+/// One segment of a request split across the CPUs
+struct ebb_cipher_seg {
+   struct work_struct work;
+   struct ebb_key *key;
+   int enc;
+   struct scatterlist *src, *dst;           ///< The ranges of the segment
+   unsigned int src_n, dst_n;
+   unsigned int len;
+   u8 iv[AES_BLOCK_SIZE];                   ///< IV of the first block of the segment
+   int err;                                 ///< Result of the segment
+};
+
+/// Work function of a segment
+static void ebb_cipher_seg_work(struct work_struct *work){
+   struct ebb_cipher_seg *w = container_of(work, struct ebb_cipher_seg, work);
+
+   w->err = ebb_cipher_sg(w->key, w->enc, w->src, w->src_n, w->dst, w->dst_n, w->len, w->iv);
+}
+
+/** @brief Splits a request into one segment per online CPU and runs them on the module
+ *  workqueue, then waits for them in order. The IV of every segment is worked out before any
+ *  segment starts, since an in place CBC decryption overwrites the ciphertext block a segment
+ *  takes its IV from: CBC takes the last ciphertext block before the segment, CTR moves the
+ *  counter by the blocks before it and XTS the sector number by the data units before it. The
+ *  result is the same as the one of ebb_cipher_sg() on the whole request.
+ *  @param k The AES key
+ *  @param enc 1 encrypts, 0 decrypts (CBC encryption cannot be split)
+ *  @param src The input scatterlist
+ *  @param src_n The entries of src
+ *  @param dst The output scatterlist
+ *  @param dst_n The entries of dst
+ *  @param len Length of the data, a multiple of ebb_cipher_unit()
+ *  @param iv The IV, updated on return
+ *  @return 0 on success, the error of the first failed segment otherwise
+ */
+static int ebb_cipher_par(struct ebb_key *k, int enc, struct scatterlist *src, unsigned int src_n,
+                          struct scatterlist *dst, unsigned int dst_n, unsigned int len, u8 *iv){
+   struct ebb_cipher_seg *w;
+   unsigned int unit = ebb_cipher_unit(k), units = len / unit, nr, i, start;
+   u8 next_iv[AES_BLOCK_SIZE];
+   int ret = 0;
+
+   nr = min(num_online_cpus(), units);
+   w = kcalloc_node(nr, sizeof(*w), GFP_KERNEL, k->node);
+   if (!w)
+      return -ENOMEM;
+   for (i = 0; i < nr && !ret; i++){
+      start = (u64)units * i / nr * unit;
+      w[i].key = k;
+      w[i].enc = enc;
+      w[i].len = (u64)units * (i + 1) / nr * unit - start;
+      if (k->alg != EBB_ALG_AES_CBC){
+         memcpy(w[i].iv, iv, AES_BLOCK_SIZE);
+         ebb_iv_advance(k, w[i].iv, start / unit);
+      }
+      else if (i == 0)
+         memcpy(w[i].iv, iv, AES_BLOCK_SIZE);
+      else
+         sg_pcopy_to_buffer(src, src_n, w[i].iv, AES_BLOCK_SIZE, start - AES_BLOCK_SIZE);
+      w[i].src = ebb_sg_range(src, src_n, start, w[i].len, &w[i].src_n);
+      w[i].dst = IS_ERR(w[i].src) ? w[i].src : ebb_sg_range(dst, dst_n, start, w[i].len, &w[i].dst_n);
+      if (IS_ERR(w[i].dst)){
+         ret = PTR_ERR(w[i].dst);
+         if (!IS_ERR(w[i].src))
+            kfree(w[i].src);
+         w[i].src = w[i].dst = NULL;
+      }
+   }
+   if (ret)
+      goto out;
+
+   if (k->alg == EBB_ALG_AES_CBC)
+      sg_pcopy_to_buffer(src, src_n, next_iv, AES_BLOCK_SIZE, len - AES_BLOCK_SIZE);
+   for (i = 0; i < nr; i++){
+      INIT_WORK(&w[i].work, ebb_cipher_seg_work);
+      queue_work_on(ebb_spread_cpu(k->node, i), ebb_wq, &w[i].work);
+   }
+   for (i = 0; i < nr; i++){
+      flush_work(&w[i].work);
+      if (!ret)
+         ret = w[i].err;
+   }
+   if (!ret && k->alg == EBB_ALG_AES_CBC)
+      memcpy(iv, next_iv, AES_BLOCK_SIZE);
+   else if (!ret)
+      ebb_iv_advance(k, iv, units);
+
+out:
+   for (i = 0; i < nr; i++){
+      kfree(w[i].src);
+      kfree(w[i].dst);
+   }
+   kfree(w);
+   return ret;
+}
+
+/** @brief Runs a request of user buffers with ebb_cipher_par(). The workers cannot reach the
+ *  memory of the caller, so the buffers are pinned for the duration of the request instead of
+ *  going through a bounce buffer; in place requests are pinned once.
+ *  @param k The AES key
+ *  @param enc 1 encrypts, 0 decrypts
+ *  @param in User pointer to the input
+ *  @param out User pointer to the output
+ *  @param len Length of the data
+ *  @param iv The IV, updated on return
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_cipher_pinned(struct ebb_key *k, int enc, const u8 __user *in, u8 __user *out,
+                             unsigned int len, u8 *iv){
+   struct ebb_fixed_buf src, dst;
+   int ret;
+
+   memset(&src, 0, sizeof(src));
+   memset(&dst, 0, sizeof(dst));
+   ret = ebb_fixed_pin(&dst, (unsigned long)out, len, 1);
+   if (ret)
+      return ret;
+   if (in != out){
+      ret = ebb_fixed_pin(&src, (unsigned long)in, len, 0);
+      if (ret){
+         ebb_fixed_unpin(&dst);
+         return ret;
+      }
+      ret = ebb_cipher_par(k, enc, src.sgt.sgl, src.sgt.nents, dst.sgt.sgl, dst.sgt.nents, len, iv);
+      ebb_fixed_unpin(&src);
+   }
+   else {
+      ret = ebb_cipher_par(k, enc, dst.sgt.sgl, dst.sgt.nents, dst.sgt.sgl, dst.sgt.nents, len, iv);
+   }
+   ebb_fixed_unpin(&dst);
+   return ret;
+}
+//FIM da CIFRA PARALELA////
+
+//HASH MULTI-BUFFER////
+
+/// Multi-buffer drivers of the SHA digests, indexed by alg
+static const char * const ebb_mb_driver[] = {
+   [EBB_ALG_SHA1] = "sha1_mb",
+   [EBB_ALG_SHA256] = "sha256_mb",
+   [EBB_ALG_SHA512] = "sha512_mb",
+};
+static struct crypto_ahash *ebb_mb_tfm[ARRAY_SIZE(ebb_mb_driver)]; ///< Shared, allocated on first use
+static DEFINE_MUTEX(ebb_mb_lock);           ///< Serializes the allocation of ebb_mb_tfm
+
+/// Completion tracking of one batch of asynchronous digests
+struct ebb_mb_ctx {
+   atomic_t pending;                        ///< Requests in flight plus one for the submitter
+   int err;                                 ///< First error of the batch
+   struct completion done;                  ///< Completed when pending drops to zero
+};
+
+/** @brief Returns the shared ahash of a digest. The multi-buffer driver (x86 AVX2, up to 8
+ *  SHA-256 lanes) is preferred: it collects the requests in flight and hashes them side by side
+ *  in the vector lanes. It is only reachable by its driver name, and where it is not built the
+ *  generic implementation is used, which hashes the messages one after the other.
+ *  @param alg EBB_ALG_SHA1, EBB_ALG_SHA256 or EBB_ALG_SHA512
+ *  @return the transform or an ERR_PTR()
+ */
+static struct crypto_ahash *ebb_mb_get(__u32 alg){
+   struct crypto_ahash *tfm;
+   unsigned int digestlen;
+   const char *name = ebb_hash_name(alg, &digestlen);
+
+   if (!name || alg >= ARRAY_SIZE(ebb_mb_driver) || !ebb_mb_driver[alg])
+      return ERR_PTR(-EINVAL);
+   mutex_lock(&ebb_mb_lock);
+   tfm = ebb_mb_tfm[alg];
+   if (!tfm){
+      tfm = crypto_alloc_ahash(ebb_mb_driver[alg], 0, 0);
+      if (IS_ERR(tfm))
+         tfm = crypto_alloc_ahash(name, 0, 0);
+      if (!IS_ERR(tfm)){
+         ebb_mb_tfm[alg] = tfm;
+         printk(KERN_INFO "EBBChar: Batched %s uses %s\n", name,
+                crypto_tfm_alg_driver_name(crypto_ahash_tfm(tfm)));
+      }
+   }
+   mutex_unlock(&ebb_mb_lock);
+   return tfm;
+}
+
+/// Frees the shared multi-buffer transforms, used when the module is unloaded
+static void ebb_mb_free(void){
+   unsigned int i;
+
+   for (i = 0; i < ARRAY_SIZE(ebb_mb_tfm); i++)
+      if (ebb_mb_tfm[i])
+         crypto_free_ahash(ebb_mb_tfm[i]);
+}
+
+/** @brief Builds the scatterlist of a piece of a kvmalloc()ed buffer. vmalloc() memory is only
+ *  virtually contiguous, so it gets one entry per page it spans.
+ *  @param sg The entries to fill, enough for every page of the piece
+ *  @param buf The piece
+ *  @param len Length of the piece
+ *  @return the number of entries used, at least one
+ */
+static unsigned int ebb_sg_kvbuf(struct scatterlist *sg, u8 *buf, unsigned int len){
+   unsigned int n, i, chunk;
+
+   if (!is_vmalloc_addr(buf)){
+      sg_init_one(sg, buf, len);
+      return 1;
+   }
+   n = len ? DIV_ROUND_UP(offset_in_page(buf) + len, PAGE_SIZE) : 1;
+   sg_init_table(sg, n);
+   for (i = 0; len; i++){
+      chunk = min_t(unsigned int, len, PAGE_SIZE - offset_in_page(buf));
+      sg_set_page(&sg[i], vmalloc_to_page(buf), chunk, offset_in_page(buf));
+      buf += chunk;
+      len -= chunk;
+   }
+   return n;
+}
+
+/// Completion callback of a batched digest
+static void ebb_mb_cb(struct crypto_async_request *req, int error){
+   struct ebb_mb_ctx *ctx = req->data;
+
+   if (error == -EINPROGRESS)              // a backlogged request was started
+      return;
+   if (error)
+      ctx->err = error;
+   if (atomic_dec_and_test(&ctx->pending))
+      complete(&ctx->done);
+}
+
+/** @brief The checksum variant of EBBCHAR_IOC_HASH_BATCH. A checksum of a short message costs
+ *  less than an asynchronous request, so the messages go one after the other through a single
+ *  bounce buffer and the checksums are returned with one copy.
+ *  @param session The session
+ *  @param arg The batch, already copied from user space
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_checksum_batch(struct ebb_session *session, struct ebb_hash_batch *arg){
+   struct ebb_iovec *iov;
+   unsigned int i, ds, maxlen = 0;
+   u8 *bounce = NULL, *digests = NULL;
+   size_t total = 0;
+   int ret = 0;
+
+   ebb_hash_name(arg->alg, &ds);
+   iov = memdup_user(u64_to_user_ptr(arg->msgs), arg->count * sizeof(*iov));
+   if (IS_ERR(iov))
+      return PTR_ERR(iov);
+   for (i = 0; i < arg->count; i++){
+      if (iov[i].len > EBB_MAX_MSG_SIZE){
+         ret = -EINVAL;
+         goto out;
+      }
+      maxlen = max(maxlen, iov[i].len);
+   }
+   bounce = kvmalloc_node(maxlen ? maxlen : 1, GFP_KERNEL, session->node);
+   digests = kmalloc_node(arg->count * ds, GFP_KERNEL, session->node);
+   if (!bounce || !digests){
+      ret = -ENOMEM;
+      goto out;
+   }
+   for (i = 0; i < arg->count && !ret; i++){
+      if (copy_from_user(bounce, u64_to_user_ptr(iov[i].base), iov[i].len))
+         ret = -EFAULT;
+      else
+         ebb_checksum(arg->alg, bounce, iov[i].len, digests + i * ds);
+      total += iov[i].len;
+   }
+   ebb_account(session, total);
+   if (!ret && copy_to_user(u64_to_user_ptr(arg->digests), digests, arg->count * ds))
+      ret = -EFAULT;
+
+out:
+   kfree(digests);
+   kvfree(bounce);
+   kfree(iov);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_HASH_BATCH. All the messages are submitted before the first one
+ *  is waited for, which is what lets a multi-buffer driver fill its lanes; one transform is
+ *  shared by every batch instead of a crypto_alloc_shash() per message. The messages are
+ *  copied back to back into one buffer and the requests carved from one block, so a batch
+ *  costs a fixed number of allocations whatever its size.
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_hash_batch
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_hash_batch(struct ebb_session *session, struct ebb_hash_batch __user *uarg){
+   struct ebb_hash_batch arg;
+   struct ebb_iovec *iov;
+   struct scatterlist *sgl = NULL, *sg;
+   struct ahash_request *req;
+   struct ebb_mb_ctx ctx;
+   struct crypto_ahash *tfm;
+   unsigned int i, ds, stride, nents = 0;
+   size_t total = 0;
+   u8 *data = NULL, *reqs = NULL, *digests = NULL, *p;
+   int ret = 0;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   if (arg.count == 0 || arg.count > EBB_MAX_BATCH)
+      return -EINVAL;
+   if (ebb_is_checksum(arg.alg))
+      return ebb_checksum_batch(session, &arg);
+   tfm = ebb_mb_get(arg.alg);
+   if (IS_ERR(tfm))
+      return PTR_ERR(tfm);
+   ds = crypto_ahash_digestsize(tfm);
+   iov = memdup_user(u64_to_user_ptr(arg.msgs), arg.count * sizeof(*iov));
+   if (IS_ERR(iov))
+      return PTR_ERR(iov);
+   for (i = 0; i < arg.count; i++){
+      if (iov[i].len > EBB_MAX_MSG_SIZE){
+         ret = -EINVAL;
+         goto out;
+      }
+      total += iov[i].len;
+      nents += DIV_ROUND_UP(iov[i].len, PAGE_SIZE) + 1;   // pages spanned at any offset
+   }
+   stride = ALIGN(sizeof(struct ahash_request) + crypto_ahash_reqsize(tfm), CRYPTO_MINALIGN);
+   data = kvmalloc_node(total ? total : 1, GFP_KERNEL, session->node);
+   sgl = kvmalloc_node(nents * sizeof(*sgl), GFP_KERNEL, session->node);
+   reqs = kvmalloc_node(arg.count * stride, GFP_KERNEL, session->node);
+   digests = kmalloc_node(arg.count * ds, GFP_KERNEL, session->node);
+   if (!data || !sgl || !reqs || !digests){
+      ret = -ENOMEM;
+      goto out;
+   }
+   p = data;
+   for (i = 0; i < arg.count; i++){
+      if (copy_from_user(p, u64_to_user_ptr(iov[i].base), iov[i].len)){
+         ret = -EFAULT;
+         goto out;
+      }
+      p += iov[i].len;
+   }
+
+   atomic_set(&ctx.pending, 1);
+   ctx.err = 0;
+   init_completion(&ctx.done);
+   p = data;
+   sg = sgl;
+   for (i = 0; i < arg.count; i++){
+      req = (struct ahash_request *)(reqs + i * stride);
+      ahash_request_set_tfm(req, tfm);
+      ahash_request_set_callback(req, CRYPTO_TFM_REQ_MAY_BACKLOG, ebb_mb_cb, &ctx);
+      ahash_request_set_crypt(req, sg, digests + i * ds, iov[i].len);
+      sg += ebb_sg_kvbuf(sg, p, iov[i].len);
+      p += iov[i].len;
+      atomic_inc(&ctx.pending);
+      ret = crypto_ahash_digest(req);
+      if (ret == -EINPROGRESS || ret == -EBUSY)
+         continue;
+      if (ret)                                // finished synchronously, the callback is not run
+         ctx.err = ret;
+      atomic_dec(&ctx.pending);
+   }
+   if (!atomic_dec_and_test(&ctx.pending))
+      wait_for_completion(&ctx.done);
+   ret = ctx.err;
+   ebb_account(session, total);
+   if (!ret && copy_to_user(u64_to_user_ptr(arg.digests), digests, arg.count * ds))
+      ret = -EFAULT;
+
+out:
+   kfree(digests);
+   kvfree(reqs);
+   kvfree(sgl);
+   kvfree(data);
+   kfree(iov);
+   return ret;
+}
+//FIM do HASH MULTI-BUFFER////
+
+//HASH EM ARVORE////
+
+#define EBB_TREE_LEAF 0x00                  ///< Domain prefix of a leaf digest
+#define EBB_TREE_NODE 0x01                  ///< Domain prefix of an inner node digest
+
+/// One tree digest, shared by its leaf workers
+struct ebb_tree_ctx {
+   struct crypto_shash *tfm;                ///< Unkeyed digest, shared by the workers
+   unsigned int ds;                         ///< Digest size
+   struct file *file;                       ///< Source file, NULL for a registered buffer
+   struct ebb_fixed_buf *buf;               ///< Source buffer, NULL for a file
+   u64 offset;                              ///< Start of the input in the source
+   u64 len;                                 ///< Length of the input
+   unsigned int chunk;                      ///< Bytes per leaf
+   u8 *leaves;                              ///< nr_leaves digests, written by the workers
+};
+
+/// The leaves [first, last) of a tree digest, hashed on one CPU
+struct ebb_tree_work {
+   struct work_struct work;
+   struct ebb_tree_ctx *ctx;
+   unsigned int first, last;
+   int err;                                 ///< Result of the range
+};
+
+/** @brief Feeds a range of a registered buffer into a digest, one mapped page at a time
+ *  @param desc The digest state
+ *  @param b The registered buffer
+ *  @param start Start of the range
+ *  @param len Length of the range
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_tree_update_buf(struct shash_desc *desc, struct ebb_fixed_buf *b, u64 start,
+                               u64 len){
+   struct sg_mapping_iter miter;
+   unsigned int n;
+   int ret = 0;
+
+   sg_miter_start(&miter, b->sgt.sgl, b->sgt.nents, SG_MITER_FROM_SG);
+   if (!sg_miter_skip(&miter, start))
+      ret = -EINVAL;
+   while (!ret && len && sg_miter_next(&miter)){
+      n = min_t(u64, miter.length, len);
+      ret = crypto_shash_update(desc, miter.addr, n);
+      len -= n;
+   }
+   sg_miter_stop(&miter);
+   return ret;
+}
+
+/** @brief Feeds a range of a file into a digest
+ *  @param desc The digest state
+ *  @param file The file
+ *  @param pos Start of the range
+ *  @param len Length of the range
+ *  @param bounce A SZ_64K buffer the file is read into
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_tree_update_file(struct shash_desc *desc, struct file *file, loff_t pos, u64 len,
+                                u8 *bounce){
+   ssize_t n;
+   int ret = 0;
+
+   while (!ret && len){
+      n = kernel_read(file, bounce, min_t(u64, len, SZ_64K), &pos);
+      if (n <= 0)                           // the file shrank under us
+         return n < 0 ? n : -EIO;
+      ret = crypto_shash_update(desc, bounce, n);
+      len -= n;
+   }
+   return ret;
+}
+
+/// Work function of a leaf range -- digests H(0x00 || chunk) of every leaf of the range
+static void ebb_tree_leaf_work(struct work_struct *work){
+   struct ebb_tree_work *w = container_of(work, struct ebb_tree_work, work);
+   struct ebb_tree_ctx *ctx = w->ctx;
+   SHASH_DESC_ON_STACK(desc, ctx->tfm);
+   const u8 prefix = EBB_TREE_LEAF;
+   u8 *bounce = NULL;
+   u64 start, n;
+   unsigned int i;
+   int ret = 0;
+
+   if (ctx->file){
+      bounce = kvmalloc(SZ_64K, GFP_KERNEL);
+      if (!bounce){
+         w->err = -ENOMEM;
+         return;
+      }
+   }
+   desc->tfm = ctx->tfm;
+   desc->flags = 0x0;
+   for (i = w->first; !ret && i < w->last; i++){
+      start = (u64)i * ctx->chunk;
+      n = min_t(u64, ctx->chunk, ctx->len - start);
+      ret = crypto_shash_init(desc);
+      if (!ret)
+         ret = crypto_shash_update(desc, &prefix, 1);
+      if (!ret && n && ctx->file)
+         ret = ebb_tree_update_file(desc, ctx->file, ctx->offset + start, n, bounce);
+      else if (!ret && n)
+         ret = ebb_tree_update_buf(desc, ctx->buf, ctx->offset + start, n);
+      if (!ret)
+         ret = crypto_shash_final(desc, ctx->leaves + (size_t)i * ctx->ds);
+   }
+   shash_desc_zero(desc);
+   kvfree(bounce);
+   w->err = ret;
+}
+
+/** @brief Digests all the leaves of a tree. The leaves are split into one contiguous range per
+ *  online CPU, queued on the module workqueue (see ebb_spread_cpu()) and waited for in order.
+ *  @param ctx The tree digest
+ *  @param nr_leaves Number of leaves
+ *  @param node NUMA node of the session
+ *  @return 0 on success, the first error of the ranges otherwise
+ */
+static int ebb_tree_leaves(struct ebb_tree_ctx *ctx, unsigned int nr_leaves, int node){
+   struct ebb_tree_work *w;
+   unsigned int nr = min(num_online_cpus(), nr_leaves), i;
+   int ret = 0;
+
+   w = kcalloc_node(nr, sizeof(*w), GFP_KERNEL, node);
+   if (!w)
+      return -ENOMEM;
+   for (i = 0; i < nr; i++){
+      w[i].ctx = ctx;
+      w[i].first = (u64)nr_leaves * i / nr;
+      w[i].last = (u64)nr_leaves * (i + 1) / nr;
+      INIT_WORK(&w[i].work, ebb_tree_leaf_work);
+      queue_work_on(ebb_spread_cpu(node, i), ebb_wq, &w[i].work);
+   }
+   for (i = 0; i < nr; i++){
+      flush_work(&w[i].work);
+      if (!ret)
+         ret = w[i].err;
+   }
+   kfree(w);
+   return ret;
+}
+
+/** @brief Combines the leaves of a tree into its root, level by level, in place. Node j of a
+ *  level only reads nodes 2j and 2j+1 of the level below, which were already consumed when j
+ *  is overwritten.
+ *  @param tfm The digest
+ *  @param nodes The leaves, the root is left in the first entry
+ *  @param n Number of leaves
+ *  @return 0 on success, a negative errno otherwise
+ */
+static int ebb_tree_combine(struct crypto_shash *tfm, u8 *nodes, unsigned int n){
+   SHASH_DESC_ON_STACK(desc, tfm);
+   unsigned int ds = crypto_shash_digestsize(tfm), j;
+   const u8 prefix = EBB_TREE_NODE;
+   int ret = 0;
+
+   desc->tfm = tfm;
+   desc->flags = 0x0;
+   while (!ret && n > 1){
+      for (j = 0; !ret && j < n / 2; j++){
+         ret = crypto_shash_init(desc);
+         if (!ret)
+            ret = crypto_shash_update(desc, &prefix, 1);
+         if (!ret)
+            ret = crypto_shash_update(desc, nodes + 2 * j * ds, 2 * ds);
+         if (!ret)
+            ret = crypto_shash_final(desc, nodes + j * ds);
+      }
+      if (n % 2)                            // the odd node is promoted unchanged
+         memmove(nodes + (n / 2) * ds, nodes + (n - 1) * ds, ds);
+      n = (n + 1) / 2;
+   }
+   shash_desc_zero(desc);
+   return ret;
+}
+
+/** @brief Handles EBBCHAR_IOC_TREE_HASH -- the parallel tree digest of a file or of a registered
+ *  buffer, see struct ebb_tree_hash for the format
+ *  @param session The session
+ *  @param uarg User pointer to a struct ebb_tree_hash
+ *  @return 0 on success, -ENOSPC if the leaves did not fit, a negative errno otherwise
+ */
+static int ebb_tree_hash(struct ebb_session *session, struct ebb_tree_hash __user *uarg){
+   struct ebb_tree_hash arg;
+   struct ebb_tree_ctx ctx;
+   struct fd f = { NULL };
+   const char *name;
+   u64 size, nr;
+   int ret;
+
+   if (copy_from_user(&arg, uarg, sizeof(arg)))
+      return -EFAULT;
+   name = ebb_hash_name(arg.alg, &arg.digestlen);
+   if (!name || arg.chunk_size < EBB_MIN_TREE_CHUNK)
+      return -EINVAL;
+   memset(&ctx, 0, sizeof(ctx));
+   ctx.chunk = arg.chunk_size;
+   ctx.ds = arg.digestlen;
+
+   down_read(&session->bufs_sem);
+   if (arg.fd >= 0){
+      f = fdget(arg.fd);
+      if (!f.file){
+         ret = -EBADF;
+         goto out;
+      }
+      if (!S_ISREG(file_inode(f.file)->i_mode) || !(f.file->f_mode & FMODE_READ)){
+         ret = -EINVAL;
+         goto out;
+      }
+      ctx.file = f.file;
+      size = i_size_read(file_inode(f.file));
+   }
+   else if (arg.index < session->nr_bufs){
+      ctx.buf = &session->bufs[arg.index];
+      size = ctx.buf->len;
+   }
+   else {
+      ret = -EINVAL;
+      goto out;
+   }
+   if (arg.offset > size || arg.len > size - arg.offset){
+      ret = -EINVAL;
+      goto out;
+   }
+   ctx.offset = arg.offset;
+   ctx.len = arg.len ? arg.len : size - arg.offset;
+   nr = max_t(u64, DIV_ROUND_UP(ctx.len, ctx.chunk), 1);
+   if (nr > EBB_MAX_TREE_LEAVES){
+      ret = -E2BIG;
+      goto out;
+   }
+   arg.nr_leaves = nr;
+   if (arg.leaves && arg.max_leaves < nr){
+      ret = -ENOSPC;
+      goto out;
+   }
+
+   ctx.tfm = crypto_alloc_shash(name, CRYPTO_ALG_TYPE_SHASH, 0);
+   if (IS_ERR(ctx.tfm)){
+      pr_info("can't alloc alg %s\n", name);
+      ret = PTR_ERR(ctx.tfm);
+      goto out;
+   }
+   ctx.leaves = kvmalloc_node(nr * ctx.ds, GFP_KERNEL, session->node);
+   if (!ctx.leaves)
+      ret = -ENOMEM;
+   else
+      ret = ebb_tree_leaves(&ctx, nr, session->node);
+   if (!ret && arg.leaves && copy_to_user(u64_to_user_ptr(arg.leaves), ctx.leaves, nr * ctx.ds))
+      ret = -EFAULT;
+   if (!ret)
+      ret = ebb_tree_combine(ctx.tfm, ctx.leaves, nr);
+   if (!ret)
+      memcpy(arg.digest, ctx.leaves, ctx.ds);
+   kvfree(ctx.leaves);
+   crypto_free_shash(ctx.tfm);
+   ebb_account(session, ctx.len);
+
+out:
+   if (f.file)
+      fdput(f);
+   up_read(&session->bufs_sem);
+   if ((!ret || ret == -ENOSPC) && copy_to_user(uarg, &arg, sizeof(arg)))
+      ret = -EFAULT;
+   return ret;
+}
+//FIM do HASH EM ARVORE////
+
+/** @brief The ioctl entry point of the device, see ebbchar_ioctl.h for the commands
+ *  @param filep A pointer to a file object
+ *  @param cmd The EBBCHAR_IOC_* command
+ *  @param arg The user pointer argument of the command
+ */
+static long dev_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   struct ebb_session *session = filep->private_data;
+   void __user *argp = (void __user *)arg;
+   __s32 handle;
+
+   switch (cmd){
+   case EBBCHAR_IOC_SETKEY:
+      return ebb_setkey(session, argp);
+   case EBBCHAR_IOC_DELKEY:
+      if (get_user(handle, (__s32 __user *)argp))
+         return -EFAULT;
+      return ebb_delkey(session, handle);
+   case EBBCHAR_IOC_MAC:
+      return ebb_mac(session, argp);
+   case EBBCHAR_IOC_MAC_BATCH:
+      return ebb_mac_batch(session, argp);
+   case EBBCHAR_IOC_CIPHER:
+      return ebb_cipher(session, argp);
+   case EBBCHAR_IOC_HASH:
+      return ebb_hash(session, argp);
+   case EBBCHAR_IOC_HASH_FD:
+      return ebb_hash_fd(session, argp);
+   case EBBCHAR_IOC_HASH_INIT:
+      return ebb_stream_init(session, argp);
+   case EBBCHAR_IOC_HASH_UPDATE:
+      return ebb_stream_update(session, argp);
+   case EBBCHAR_IOC_HASH_FINAL:
+      return ebb_stream_final(session, argp);
+   case EBBCHAR_IOC_REGISTER_BUFFERS:
+      return ebb_register_buffers(session, argp);
+   case EBBCHAR_IOC_UNREGISTER_BUFFERS:
+      return ebb_unregister_buffers(session);
+   case EBBCHAR_IOC_FIXED:
+      return ebb_fixed(session, argp);
+   case EBBCHAR_IOC_HASH_BATCH:
+      return ebb_hash_batch(session, argp);
+   case EBBCHAR_IOC_TREE_HASH:
+      return ebb_tree_hash(session, argp);
+   default:
+      return -ENOTTY;
+   }
+}
+
+#ifdef CONFIG_COMPAT
+/** @brief The ioctl entry point of 32 bit callers. The structs of ebbchar_ioctl.h have one
+ *  layout for both ABIs, so only the argument needs converting to a user pointer.
+ *  @param filep A pointer to a file object
+ *  @param cmd The EBBCHAR_IOC_* command
+ *  @param arg The 32 bit user pointer argument of the command
+ */
+static long dev_compat_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+   return dev_ioctl(filep, cmd, (unsigned long)compat_ptr(arg));
+}
+#endif
+
+static ssize_t dev_read(struct file *filep, char *buffer, size_t len, loff_t *offset){
+struct ebb_session *session = filep->private_data;
 int error_count = 0;
    // copy_to_user has the format ( * to, *from, size) and returns 0 on success
-   error_count = copy_to_user(buffer, message, size_of_message);
+   error_count = copy_to_user(buffer, session->message, session->size_of_message);
 
    if (error_count==0){           // success!
-      printk(KERN_INFO "EBBChar: Sent %d characters to the user\n", size_of_message);
-      return (size_of_message=0); // clear the position to the start and return 0
+      printk(KERN_INFO "EBBChar: Sent %d characters to the user\n", session->size_of_message);
+      return (session->size_of_message=0); // clear the position to the start and return 0
    }
    else {
       printk(KERN_INFO "EBBChar: Failed to send %d characters to the user\n", error_count);
@@ -448,7 +3089,7 @@ void convert_hexa(unsigned char* input, char* output){//string to hex
 }
 /*****************************************/
 
-void converter(char* vet){
+void converter(const char *encript, char* vet){
 int i=0, j=0;
 unsigned char num;
 while(i<16){
@@ -469,8 +3110,9 @@ j++;
 
 /************************************************/
 static ssize_t dev_write(struct file *filep, const char *buffer, size_t len, loff_t *offset){
- 
+struct ebb_session *session = filep->private_data;
 size_t lenk;
+u8 *copy;
 	int rett;
 	int j,i;
  	unsigned int hash_len;
@@ -490,31 +3132,53 @@ int a;
 switch(option)
    {
    case 'e':
-      a = test_skcipher(16, string, option, number);
-	converter(vet);
-	sprintf(message, "Encript: %s", vet);
+      a = test_skcipher(session, 16, string, option, number);
+	converter(session->encript, vet);
+	sprintf(session->message, "Encript: %s", vet);
 
       break;
   case 'd':
 
-      a = test_skcipher(16, string, option, number);
-	sprintf(message, "Decript :%s", encript);
+      a = test_skcipher(session, 16, string, option, number);
+	sprintf(session->message, "Decript :%s", session->encript);
 
       break;
    case 'h':
-lenk = strlen(buffer+2);
-      printk(KERN_INFO "buffer:%s (tamanho: %d)", buffer+2,lenk);
-      rett=test_hash(buffer+2,lenk, buffer_out,&hash_len);
+      if (len > EBB_MAX_HASH_SIZE)
+         return -EINVAL;
+      copy = memdup_user(buffer, len);           // hash a copy, buffer is user memory
+      if (IS_ERR(copy))
+         return PTR_ERR(copy);
+      lenk = len >= 2 ? len - 2 : 0;
+      printk(KERN_INFO "buffer:%.*s (tamanho: %zu)", (int)lenk, (char *)copy+2, lenk);
+      rett=ebb_cached_hash(EBB_ALG_SHA1, copy+2,lenk, session->buffer_out,&hash_len);
+      kfree(copy);
       printk(KERN_INFO "Resposta %d e tamanho:  %d", rett, hash_len);
 
       j = 0;
          for (i = 0; i < 20; i++){
-            sprintf(buffer + j, "%02x", buffer_out[i] & 0xff);
+            sprintf(session->message + j, "%02x", session->buffer_out[i] & 0xff);
             j += 2;
          }
 w=0;
-while(w<strlen(buffer)-2){printk(KERN_INFO "Valor da hash: %x", buffer_out[w]); w++;}
-sprintf(message, "%s", buffer);   // appending received string with its length
+while(!rett && w<hash_len){printk(KERN_INFO "Valor da hash: %x", session->buffer_out[w]); w++;}
+      break;
+   case 'c':
+   case 'x':
+      if (len > EBB_MAX_HASH_SIZE)
+         return -EINVAL;
+      copy = memdup_user(buffer, len);           // checksum a copy, buffer is user memory
+      if (IS_ERR(copy))
+         return PTR_ERR(copy);
+      if (len >= 2 && option == 'c'){
+         ebb_checksum(EBB_ALG_CRC32C, copy + 2, len - 2, (u8 *)session->buffer_out);
+         sprintf(session->message, "%08x", get_unaligned_le32(session->buffer_out));
+      }
+      else if (len >= 2){
+         ebb_checksum(EBB_ALG_XXH64, copy + 2, len - 2, (u8 *)session->buffer_out);
+         sprintf(session->message, "%016llx", get_unaligned_le64(session->buffer_out));
+      }
+      kfree(copy);
       break;
    default:
       break;
@@ -524,7 +3188,8 @@ sprintf(message, "%s", buffer);   // appending received string with its length
 
   
   // sprintf(message, "%s(%zu letters) %s", buffer, len, valor);   // appending received string with its length
-   size_of_message = strlen(message);                 // store the length of the stored message
+   session->size_of_message = strlen(session->message); // store the length of the stored message
+   ebb_account(session, len);
    printk(KERN_INFO "EBBChar: Received %zu characters from the user\n", len);
    return len;
 }
@@ -535,6 +3200,21 @@ sprintf(message, "%s", buffer);   // appending received string with its length
  *  @param filep A pointer to a file object (defined in linux/fs.h)
  */
 static int dev_release(struct inode *inodep, struct file *filep){
+   struct ebb_session *session = filep->private_data;
+   int i;
+
+   for (i = 0; i < EBB_MAX_KEYS; i++)                 // drop the key handles left open
+      ebb_key_free(session->keys[i]);
+   ebb_stream_reset(session);                         // drop an unfinished streaming hash
+   mutex_destroy(&session->stream_lock);
+   down_write(&session->bufs_sem);                    // unpin the registered buffers
+   ebb_fixed_release(session);
+   up_write(&session->bufs_sem);
+   for (i = 0; i < ARRAY_SIZE(session->fixed_tfm); i++)
+      if (session->fixed_tfm[i])
+         crypto_free_shash(session->fixed_tfm[i]);
+   kfree(session);
+   filep->private_data = NULL;
    mutex_unlock(&ebbchar_mutex);                      // release the mutex (i.e., lock goes up)
    printk(KERN_INFO "EBBChar: Device successfully closed\n");
    return 0;
@@ -0,0 +1,492 @@
+/**
+ * @file   ebbcrypt.c
+ * @brief  A command line tool that streams stdin or a file through the /dev/ebbchar LKM to
+ * encrypt (AES-CBC with PKCS#7 padding), decrypt or hash it. The input is cut in chunks that go
+ * through a ring of in-flight slots: one thread reads, -j threads talk to the device and one
+ * thread writes, so reading, device processing and writing overlap.
+ *
+ * Decryption chunks are independent (the IV of a chunk is the last ciphertext block of the one
+ * before) and run concurrently. Encryption and hashing are chained, so their device calls run
+ * one after the other, still overlapped with the reading and writing of the other chunks.
+ *
+ * With -F the slot buffers are registered with the device once (hugepage backed when the system
+ * has huge pages available), so the cipher runs on the pinned pages without any copy.
+ *
+ * With -T the input file is handed to the device as a whole for a tree digest of -T byte chunks
+ * hashed on all the CPUs (see struct ebb_tree_hash). It is not the plain digest of the file.
+ *
+ *    ebbcrypt -e -k <hexkey> [-i <hexiv>] [-j inflight] [-c chunk] [-F] [in [out]]
+ *    ebbcrypt -d -k <hexkey> [-i <hexiv>] [-j inflight] [-c chunk] [-F] [in [out]]
+ *    ebbcrypt -H sha1|sha256|sha512|crc32c|xxhash64 [-j inflight] [-c chunk] [in]
+ *    ebbcrypt -H sha1|sha256|sha512|crc32c|xxhash64 -T chunk file
+*/
+#include<stdio.h>
+#include<stdlib.h>
+#include<errno.h>
+#include<fcntl.h>
+#include<string.h>
+#include<unistd.h>
+#include<pthread.h>
+#include<sys/ioctl.h>
+#include<sys/mman.h>
+
+#include "ebbchar_ioctl.h"
+
+#define DEFAULT_CHUNK     (1 << 20)     ///< Default chunk size, 1MiB
+#define DEFAULT_INFLIGHT  3             ///< Default number of slots, triple buffering
+#define MAX_INFLIGHT      64
+
+enum slot_state { SLOT_FREE, SLOT_READ, SLOT_BUSY, SLOT_DONE };
+
+/// One chunk of the stream travelling from the reader to the writer
+struct slot {
+   enum slot_state state;
+   unsigned char *buf;                  ///< Chunk data, processed in place
+   size_t len;                          ///< Bytes of data in buf
+   long seq;                            ///< Position of the chunk in the stream
+   int last;                            ///< Set on the final chunk
+   unsigned char iv[EBB_BLOCK_SIZE];    ///< IV of the chunk (decryption only)
+};
+
+static char mode;                       ///< 'e', 'd' or 'h'
+static int fd_dev, fd_in = 0, fd_out = 1;
+static int key_handle = -1;
+static __u32 hash_alg;
+static size_t chunk = DEFAULT_CHUNK;
+static int inflight = DEFAULT_INFLIGHT;
+static int fixed;                       ///< Use registered buffers (-F)
+static unsigned int tree;               ///< Chunk size of a tree digest (-T), 0 for a plain one
+static unsigned char chain_iv[EBB_BLOCK_SIZE];  ///< Chaining value between encrypted chunks
+
+static struct slot slots[MAX_INFLIGHT];
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t changed = PTHREAD_COND_INITIALIZER;
+static long next_claim;                 ///< Next chunk a device thread takes
+static long next_turn;                  ///< Next chunk allowed on the device for chained modes
+static long last_seq = -1;              ///< Sequence of the final chunk once it was read
+
+static void die(const char *what){
+   perror(what);
+   exit(EXIT_FAILURE);
+}
+
+static void usage(void){
+   fprintf(stderr, "usage: ebbcrypt -e|-d -k hexkey [-i hexiv] [-j inflight] [-c chunk] [-F] [in [out]]\n"
+                   "       ebbcrypt -H sha1|sha256|sha512|crc32c|xxhash64 [-j inflight] [-c chunk] [in]\n"
+                   "       ebbcrypt -H sha1|sha256|sha512|crc32c|xxhash64 -T chunk file\n");
+   exit(EXIT_FAILURE);
+}
+
+/** @brief Parses a hex string into bytes
+ *  @return the number of bytes or -1 if the string is not valid hex or too long
+ */
+static int parse_hex(const char *hex, unsigned char *out, size_t max){
+   size_t i, n = strlen(hex);
+
+   if (n % 2 || n / 2 > max)
+      return -1;
+   for (i = 0; i < n / 2; i++){
+      if (sscanf(hex + 2 * i, "%2hhx", &out[i]) != 1)
+         return -1;
+   }
+   return n / 2;
+}
+
+/// Reads until len bytes arrived or the input ended, a pipe may return short reads
+static size_t read_full(int fd, unsigned char *buf, size_t len){
+   size_t done = 0;
+   ssize_t n;
+
+   while (done < len){
+      n = read(fd, buf + done, len - done);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         die("Failed to read the input");
+      if (n == 0)
+         break;
+      done += n;
+   }
+   return done;
+}
+
+static void write_full(int fd, const unsigned char *buf, size_t len){
+   ssize_t n;
+
+   while (len){
+      n = write(fd, buf, len);
+      if (n < 0 && errno == EINTR)
+         continue;
+      if (n < 0)
+         die("Failed to write the output");
+      buf += n;
+      len -= n;
+   }
+}
+
+/** @brief Waits until the slot of chunk seq holds chunk owner in the wanted state, lock must
+ *  be held. A slot is free for chunk seq once chunk seq - inflight left it.
+ */
+static struct slot *wait_slot(long seq, long owner, enum slot_state state){
+   struct slot *s = &slots[seq % inflight];
+
+   while (!(s->state == state && s->seq == owner))
+      pthread_cond_wait(&changed, &lock);
+   return s;
+}
+
+/** @brief The reader -- fills free slots in stream order. For encryption the final chunk gets
+ *  its PKCS#7 padding here, which is why a slot has room for one more block than a chunk.
+ */
+static void reader(void){
+   unsigned char prev_last[EBB_BLOCK_SIZE] = {0};
+   struct slot *s;
+   long seq;
+   size_t pad;
+   int last = 0;
+
+   for (seq = 0; !last; seq++){
+      pthread_mutex_lock(&lock);
+      s = wait_slot(seq, seq - inflight, SLOT_FREE);
+      pthread_mutex_unlock(&lock);
+
+      s->len = read_full(fd_in, s->buf, chunk);
+      last = s->len < chunk;                            // a full chunk is followed by a
+                                                        // (possibly empty) final chunk
+      if (mode == 'e' && last){
+         pad = EBB_BLOCK_SIZE - s->len % EBB_BLOCK_SIZE;
+         memset(s->buf + s->len, (int)pad, pad);
+         s->len += pad;
+      }
+      if (mode == 'd'){
+         if (s->len % EBB_BLOCK_SIZE || (last && seq == 0 && s->len == 0)){
+            fprintf(stderr, "ebbcrypt: ciphertext is not a multiple of the block size\n");
+            exit(EXIT_FAILURE);
+         }
+         if (seq)
+            memcpy(s->iv, prev_last, EBB_BLOCK_SIZE);
+         else
+            memcpy(s->iv, chain_iv, EBB_BLOCK_SIZE);
+         if (s->len)
+            memcpy(prev_last, s->buf + s->len - EBB_BLOCK_SIZE, EBB_BLOCK_SIZE);
+      }
+
+      pthread_mutex_lock(&lock);
+      s->seq = seq;
+      s->last = last;
+      s->state = SLOT_READ;
+      if (last)
+         last_seq = seq;
+      pthread_cond_broadcast(&changed);
+      pthread_mutex_unlock(&lock);
+   }
+}
+
+/// Runs one cipher chunk in place on its registered slot buffer
+static void process_fixed(struct slot *s, struct ebb_cipher *c){
+   struct ebb_fixed_op f;
+
+   memset(&f, 0, sizeof(f));
+   f.op = c->op;
+   f.handle = c->handle;
+   f.index = f.out_index = s - slots;
+   f.len = c->len;
+   memcpy(f.iv, c->iv, EBB_BLOCK_SIZE);
+   if (ioctl(fd_dev, EBBCHAR_IOC_FIXED, &f) < 0)
+      die("Failed to run a chunk through the device");
+   if (mode == 'e')
+      memcpy(chain_iv, f.iv, EBB_BLOCK_SIZE);
+}
+
+/// Allocates the buffer of a slot, from huge pages when -F is used and they are available
+static unsigned char *alloc_slot_buffer(size_t len){
+   void *p;
+
+   if (!fixed)
+      return malloc(len);
+   p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+   if (p == MAP_FAILED)
+      p = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+   return p == MAP_FAILED ? NULL : p;
+}
+
+/// Registers the slot buffers with the device for -F
+static void register_slots(void){
+   struct ebb_iovec iov[MAX_INFLIGHT];
+   struct ebb_register reg;
+   int i;
+
+   memset(iov, 0, sizeof(iov));
+   for (i = 0; i < inflight; i++){
+      iov[i].base = (__u64)(unsigned long)slots[i].buf;
+      iov[i].len = chunk + EBB_BLOCK_SIZE;
+   }
+   memset(&reg, 0, sizeof(reg));
+   reg.count = inflight;
+   reg.iovs = (__u64)(unsigned long)iov;
+   if (ioctl(fd_dev, EBBCHAR_IOC_REGISTER_BUFFERS, &reg) < 0)
+      die("Failed to register the buffers");
+}
+
+/// Runs one chunk through the device
+static void process(struct slot *s){
+   struct ebb_cipher c;
+   struct ebb_hash h;
+
+   if (mode == 'h'){
+      memset(&h, 0, sizeof(h));
+      h.data = (__u64)(unsigned long)s->buf;
+      h.len = s->len;
+      if (s->len && ioctl(fd_dev, EBBCHAR_IOC_HASH_UPDATE, &h) < 0)
+         die("Failed to hash a chunk");
+      return;
+   }
+   if (s->len == 0)
+      return;
+   memset(&c, 0, sizeof(c));
+   c.handle = key_handle;
+   c.op = (mode == 'e') ? EBB_OP_ENCRYPT : EBB_OP_DECRYPT;
+   c.len = s->len;
+   c.in = c.out = (__u64)(unsigned long)s->buf;
+   memcpy(c.iv, mode == 'e' ? chain_iv : s->iv, EBB_BLOCK_SIZE);
+   if (fixed){
+      process_fixed(s, &c);
+      return;
+   }
+   if (ioctl(fd_dev, EBBCHAR_IOC_CIPHER, &c) < 0)
+      die("Failed to run a chunk through the device");
+   if (mode == 'e')
+      memcpy(chain_iv, c.iv, EBB_BLOCK_SIZE);
+}
+
+/** @brief A device thread -- claims read chunks in order and processes them. Chained modes
+ *  (encryption and hashing) wait for their turn so the device sees the chunks in order.
+ */
+static void *device_thread(void *unused){
+   struct slot *s;
+   long seq;
+
+   for (;;){
+      pthread_mutex_lock(&lock);
+      seq = next_claim++;
+      s = &slots[seq % inflight];
+      while (!(s->state == SLOT_READ && s->seq == seq) && !(last_seq >= 0 && seq > last_seq))
+         pthread_cond_wait(&changed, &lock);
+      if (last_seq >= 0 && seq > last_seq){           // the stream ended before this chunk
+         pthread_mutex_unlock(&lock);
+         return NULL;
+      }
+      s->state = SLOT_BUSY;
+      if (mode != 'd')
+         while (next_turn != seq)
+            pthread_cond_wait(&changed, &lock);
+      pthread_mutex_unlock(&lock);
+
+      process(s);
+
+      pthread_mutex_lock(&lock);
+      s->state = SLOT_DONE;
+      next_turn++;
+      pthread_cond_broadcast(&changed);
+      pthread_mutex_unlock(&lock);
+   }
+}
+
+/** @brief The writer -- writes processed chunks in stream order and frees their slots. On
+ *  decryption the last block of every chunk is held back until the next chunk shows whether
+ *  it is the final block, whose PKCS#7 padding is then checked and stripped.
+ */
+static void *writer_thread(void *unused){
+   unsigned char held[EBB_BLOCK_SIZE];
+   int have_held = 0;
+   struct slot *s;
+   size_t pad, i;
+   long seq;
+   int last;
+
+   for (seq = 0; ; seq++){
+      pthread_mutex_lock(&lock);
+      s = wait_slot(seq, seq, SLOT_DONE);
+      pthread_mutex_unlock(&lock);
+
+      last = s->last;
+      if (mode == 'e')
+         write_full(fd_out, s->buf, s->len);
+      else if (mode == 'd' && s->len){
+         if (have_held)
+            write_full(fd_out, held, EBB_BLOCK_SIZE);
+         write_full(fd_out, s->buf, s->len - EBB_BLOCK_SIZE);
+         memcpy(held, s->buf + s->len - EBB_BLOCK_SIZE, EBB_BLOCK_SIZE);
+         have_held = 1;
+      }
+
+      pthread_mutex_lock(&lock);
+      s->state = SLOT_FREE;
+      pthread_cond_broadcast(&changed);
+      pthread_mutex_unlock(&lock);
+      if (last)
+         break;
+   }
+
+   if (mode == 'd'){
+      pad = have_held ? held[EBB_BLOCK_SIZE - 1] : 0;
+      if (pad == 0 || pad > EBB_BLOCK_SIZE){
+         fprintf(stderr, "ebbcrypt: bad padding, wrong key or iv?\n");
+         exit(EXIT_FAILURE);
+      }
+      for (i = EBB_BLOCK_SIZE - pad; i < EBB_BLOCK_SIZE; i++){
+         if (held[i] != pad){
+            fprintf(stderr, "ebbcrypt: bad padding, wrong key or iv?\n");
+            exit(EXIT_FAILURE);
+         }
+      }
+      write_full(fd_out, held, EBB_BLOCK_SIZE - pad);
+   }
+   return NULL;
+}
+
+/// Prints a digest like sha256sum does; checksums come little endian and are printed as numbers
+static void print_digest(const unsigned char *digest, unsigned int len, const char *name){
+   unsigned int i;
+
+   for (i = 0; i < len; i++)
+      if (hash_alg == EBB_ALG_CRC32C || hash_alg == EBB_ALG_XXH64)
+         printf("%02x", digest[len - 1 - i]);
+      else
+         printf("%02x", digest[i]);
+   printf("  %s\n", name);
+}
+
+int main(int argc, char *argv[]){
+   unsigned char keybuf[32];
+   struct ebb_setkey sk;
+   struct ebb_hash h;
+   struct ebb_tree_hash t;
+   pthread_t dev_threads[MAX_INFLIGHT], writer;
+   int opt, keylen = -1, i;
+
+   while ((opt = getopt(argc, argv, "edH:k:i:j:c:FT:")) != -1){
+      switch (opt){
+      case 'e':
+      case 'd':
+         mode = opt;
+         break;
+      case 'H':
+         mode = 'h';
+         if (!strcmp(optarg, "sha1"))
+            hash_alg = EBB_ALG_SHA1;
+         else if (!strcmp(optarg, "sha256"))
+            hash_alg = EBB_ALG_SHA256;
+         else if (!strcmp(optarg, "sha512"))
+            hash_alg = EBB_ALG_SHA512;
+         else if (!strcmp(optarg, "crc32c"))
+            hash_alg = EBB_ALG_CRC32C;
+         else if (!strcmp(optarg, "xxhash64"))
+            hash_alg = EBB_ALG_XXH64;
+         else
+            usage();
+         break;
+      case 'k':
+         keylen = parse_hex(optarg, keybuf, sizeof(keybuf));
+         break;
+      case 'i':
+         if (parse_hex(optarg, chain_iv, sizeof(chain_iv)) != EBB_BLOCK_SIZE)
+            usage();
+         break;
+      case 'j':
+         inflight = atoi(optarg);
+         break;
+      case 'c':
+         chunk = strtoul(optarg, NULL, 0);
+         break;
+      case 'F':
+         fixed = 1;
+         break;
+      case 'T':
+         tree = strtoul(optarg, NULL, 0);
+         if (tree < EBB_MIN_TREE_CHUNK)
+            usage();
+         break;
+      default:
+         usage();
+      }
+   }
+   if (!mode || inflight < 1 || inflight > MAX_INFLIGHT)
+      usage();
+   if (chunk == 0 || chunk % EBB_BLOCK_SIZE || chunk > EBB_MAX_CIPHER_SIZE - EBB_BLOCK_SIZE)
+      usage();
+   if (mode != 'h' && keylen != 16 && keylen != 24 && keylen != 32)
+      usage();
+   if (mode == 'h')                                    // the stream hash has no fixed variant
+      fixed = 0;
+   if (tree && (mode != 'h' || optind >= argc))        // the device reads the file itself
+      usage();
+   if (optind < argc && strcmp(argv[optind], "-")){
+      fd_in = open(argv[optind], O_RDONLY);
+      if (fd_in < 0)
+         die("Failed to open the input");
+   }
+   if (mode != 'h' && optind + 1 < argc){
+      fd_out = open(argv[optind + 1], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (fd_out < 0)
+         die("Failed to open the output");
+   }
+
+   fd_dev = open("/dev/ebbchar", O_RDWR);
+   if (fd_dev < 0)
+      die("Failed to open the device...");
+   if (tree){
+      memset(&t, 0, sizeof(t));
+      t.alg = hash_alg;
+      t.chunk_size = tree;
+      t.fd = fd_in;
+      if (ioctl(fd_dev, EBBCHAR_IOC_TREE_HASH, &t) < 0)
+         die("Failed to tree hash the file");
+      print_digest(t.digest, t.digestlen, argv[optind]);
+      close(fd_dev);
+      return 0;
+   }
+   if (mode == 'h'){
+      memset(&h, 0, sizeof(h));
+      h.alg = hash_alg;
+      if (ioctl(fd_dev, EBBCHAR_IOC_HASH_INIT, &h) < 0)
+         die("Failed to start the hash");
+   }
+   else {
+      memset(&sk, 0, sizeof(sk));
+      sk.alg = EBB_ALG_AES_CBC;
+      sk.keylen = keylen;
+      sk.key = (__u64)(unsigned long)keybuf;
+      if (ioctl(fd_dev, EBBCHAR_IOC_SETKEY, &sk) < 0)
+         die("Failed to set the key");
+      key_handle = sk.handle;
+   }
+
+   for (i = 0; i < inflight; i++){
+      slots[i].buf = alloc_slot_buffer(chunk + EBB_BLOCK_SIZE);   // room for the padding block
+      if (!slots[i].buf)
+         die("Failed to allocate the buffers");
+      slots[i].state = SLOT_FREE;
+      slots[i].seq = i - inflight;
+   }
+   if (fixed)
+      register_slots();
+   for (i = 0; i < inflight; i++)
+      if (pthread_create(&dev_threads[i], NULL, device_thread, NULL))
+         die("Failed to start a device thread");
+   if (pthread_create(&writer, NULL, writer_thread, NULL))
+      die("Failed to start the writer");
+
+   reader();
+   for (i = 0; i < inflight; i++)
+      pthread_join(dev_threads[i], NULL);
+   pthread_join(writer, NULL);
+
+   if (mode == 'h'){
+      if (ioctl(fd_dev, EBBCHAR_IOC_HASH_FINAL, &h) < 0)
+         die("Failed to finish the hash");
+      print_digest(h.digest, h.digestlen, optind < argc ? argv[optind] : "-");
+   }
+   close(fd_dev);
+   return 0;
+}
@@ -59,7 +59,9 @@ char nova[33];
     printf("Ola, Escolha uma Opcao: \n");
     printf("\ne- Para fazer a Criptaçao.");
     printf("\nd- Para fazer a Descriptacao.");
-    printf("\nh- Para fazer Calculo de Hash.\n");
+    printf("\nh- Para fazer Calculo de Hash.");
+    printf("\nc- Para fazer Checksum crc32c.");
+    printf("\nx- Para fazer Checksum xxhash64.\n");
     printf("\nOpcao:");
    scanf("%[^\n]%*c", stringToSend);              // Read in a string (with spaces)
    printf("Writing message to the device [%s].\n", stringToSend);